@@ -166,7 +166,7 @@ setup_page_tables:
     
     mov edi, pd_table
     mov eax, PAGE_PRESENT | PAGE_WRITABLE | PAGE_HUGE
-    mov ecx, 16 ;32
+    mov ecx, 512            ; первый 1 ГБ, 2 МБ страницами
 .setup_pd_loop:
     mov [edi], eax
     add eax, 0x200000           
@@ -2,8 +2,14 @@
 #include <stdio.h>
 #include <string.h>
 #include "pata.h"
+#include "../../pci/pci.h"
+#include "../../../kernel/mm/mem.h"
+#include "../../../kernel/idt/idt.h"
+#include "../../timer/timer.h"
 
 ata_device_t ata_devices[4];
+static ata_channel_t ata_channels[2];
+static ata_stats_t ata_stats;
 
 static void ata_delay(void) {
     for (int i = 0; i < 4; i++) {
@@ -11,6 +17,13 @@ static void ata_delay(void) {
     }
 }
 
+// 400 нс после смены устройства или блока данных: четыре чтения ALTSTATUS канала
+static void ata_settle(uint16_t control) {
+    for (int i = 0; i < 4; i++) {
+        inb(control);
+    }
+}
+
 static void ata_long_delay(void) {
     for (int i = 0; i < 1000; i++) {
         ata_delay();
@@ -21,8 +34,13 @@ uint8_t ata_get_status(ata_device_t *dev) {
     return inb(dev->base + ATA_REG_STATUS);
 }
 
-void ata_wait_busy(ata_device_t *dev) {
-    while (ata_get_status(dev) & ATA_STATUS_BSY);
+int ata_wait_busy(ata_device_t *dev) {
+    for (int timeout = ATA_POLL_TIMEOUT; timeout > 0; timeout--) {
+        if (!(ata_get_status(dev) & ATA_STATUS_BSY)) {
+            return 0;
+        }
+    }
+    return -1;
 }
 
 int ata_wait_ready(ata_device_t *dev) {
@@ -55,16 +73,28 @@ int ata_wait_ready(ata_device_t *dev) {
     return 0;
 }
 
+// Регистр устройства переписываем, только если сменился диск или старшие биты LBA
 void ata_select_drive(ata_device_t *dev, uint32_t lba) {
     uint8_t drive_reg = (dev->drive == 0 ? ATA_DRIVE_MASTER : ATA_DRIVE_SLAVE) | 
-                        ((lba >> 24) & 0x0F);
+                        ATA_DRIVE_LBA | ((lba >> 24) & 0x0F);
+    
+    if (dev->channel->selected == drive_reg) {
+        ata_stats.select_hits++;
+        return;
+    }
     
     outb(dev->base + ATA_REG_DRIVE, drive_reg);
-    ata_long_delay();
+    dev->channel->selected = drive_reg;
+    ata_stats.select_misses++;
+    
+    ata_settle(dev->control);
+    ata_wait_busy(dev);
 }
 
 int ata_identify(ata_device_t *dev) {
+    // Устройства может не быть: тут нужна длинная пауза, а не опрос BSY
     outb(dev->base + ATA_REG_DRIVE, dev->drive == 0 ? ATA_DRIVE_MASTER : ATA_DRIVE_SLAVE);
+    dev->channel->selected = 0;
     ata_long_delay();
 
     uint8_t status = ata_get_status(dev);
@@ -107,9 +137,7 @@ int ata_identify(ata_device_t *dev) {
     }
     
     uint16_t identify_data[256];
-    for (int i = 0; i < 256; i++) {
-        identify_data[i] = inw(dev->base + ATA_REG_DATA);
-    }
+    insw(dev->base + ATA_REG_DATA, identify_data, 256);
     
     memset(dev->model, 0, sizeof(dev->model));
     for (int i = 0; i < 20; i++) {
@@ -123,119 +151,492 @@ int ata_identify(ata_device_t *dev) {
         dev->model[i] = '\0';
     }
     
-    dev->sectors = (uint32_t)identify_data[60] | ((uint32_t)identify_data[61] << 16);
+    // Слово 83 бит 10 - LBA48, ёмкость тогда в словах 100-103
+    dev->lba48 = (identify_data[83] & (1 << 10)) != 0;
+    if (dev->lba48) {
+        dev->sectors = (uint64_t)identify_data[100] | ((uint64_t)identify_data[101] << 16) |
+                       ((uint64_t)identify_data[102] << 32) | ((uint64_t)identify_data[103] << 48);
+    } else {
+        dev->sectors = (uint32_t)identify_data[60] | ((uint32_t)identify_data[61] << 16);
+    }
+    
+    // Слово 48 бит 0 устарело и ничего не гарантирует: 32-битный PIO
+    // включается только для известного контроллера (ata_dma_init) или явно
+    dev->pio32 = false;
+    
+    // Слово 47 - сколько секторов READ/WRITE MULTIPLE отдаёт за одно прерывание
+    dev->max_multiple = identify_data[47] & 0xFF;
+    dev->multiple = 1;
+    
+    // Слово 49 бит 8 - DMA, слово 88 - режимы UDMA (если слово 53 бит 2), слово 63 - MWDMA
+    dev->udma_mode = -1;
+    dev->mdma_mode = -1;
+    if (identify_data[49] & (1 << 8)) {
+        if (identify_data[53] & (1 << 2)) {
+            for (int mode = 6; mode >= 0; mode--) {
+                if (identify_data[88] & (1 << mode)) {
+                    dev->udma_mode = mode;
+                    break;
+                }
+            }
+        }
+        for (int mode = 2; mode >= 0; mode--) {
+            if (identify_data[63] & (1 << mode)) {
+                dev->mdma_mode = mode;
+                break;
+            }
+        }
+    }
     
     dev->exists = 1;
-    printf("ATA Device %d: %s (%u sectors)\n", dev->drive, dev->model, dev->sectors);
+    printf("ATA Device %d: %s (%lld sectors%s)\n", dev->drive, dev->model,
+           (long long)dev->sectors, dev->lba48 ? ", LBA48" : "");
     
     return 0;
 }
 
-int ata_read_sectors(ata_device_t *dev, uint32_t lba, uint8_t count, void *buffer) {
-    if (!dev->exists || count == 0) {
-        printf("dev exists: %d, count: %d", dev->exists, count);
+static int ata_set_multiple(ata_device_t *dev) {
+    if (dev->max_multiple < 2) {
         return -1;
     }
-    
-    ata_select_drive(dev, lba);
+
+    ata_select_drive(dev, 0);
+
+    outb(dev->base + ATA_REG_SECCOUNT, dev->max_multiple);
+    outb(dev->base + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+    ata_delay();
     ata_wait_busy(dev);
 
-    outb(dev->base + ATA_REG_FEATURES, 0);
-    outb(dev->base + ATA_REG_SECCOUNT, count);
-    outb(dev->base + ATA_REG_LBA_LOW, lba & 0xFF);
-    outb(dev->base + ATA_REG_LBA_MID, (lba >> 8) & 0xFF);
-    outb(dev->base + ATA_REG_LBA_HIGH, (lba >> 16) & 0xFF);
-    
-    outb(dev->base + ATA_REG_COMMAND, ATA_CMD_READ_SECTORS);
-    
-    uint16_t *buf = (uint16_t *)buffer;
-    
-    for (int sector = 0; sector < count; sector++) {
-        ata_wait_ready(dev);
-        
-        int timeout = 1000000;
-        while (!(ata_get_status(dev) & ATA_STATUS_DRQ) && timeout > 0) {
-            uint8_t status = ata_get_status(dev);
-            if (status & ATA_STATUS_ERR) {
-                uint8_t error = inb(dev->base + ATA_REG_ERROR);
-                if (error != ATA_ERROR_ABRT && error != ATA_ERROR_IDNF) {
-                    printf("ATA Read Error: 0x%X\n", error);
-                    return -1;
-                }
-                break; 
+    if (ata_get_status(dev) & (ATA_STATUS_ERR | ATA_STATUS_DF)) {
+        return -1;
+    }
+
+    dev->multiple = dev->max_multiple;
+    return 0;
+}
+
+static inline bool ata_irqs_enabled(void) {
+    uint64_t rflags;
+    asm volatile("pushfq; pop %0" : "=r"(rflags));
+    return rflags & (1 << 9);
+}
+
+static void ata_complete(ata_channel_t *ch, ata_request_t *req, uint8_t status, int error) {
+    req->status = status;
+    req->error = error;
+    ch->active = NULL;
+    req->done = true;
+}
+
+// Один шаг активного запроса: из IRQ14/15 или опросом, когда прерывания запрещены
+static void ata_service(ata_channel_t *ch) {
+    ata_request_t *req = ch->active;
+    if (!req) {
+        inb(ch->base + ATA_REG_STATUS);
+        return;
+    }
+
+    uint8_t bm_status = 0;
+    if (req->dma) {
+        bm_status = inb(ch->bm_base + ATA_BM_STATUS);
+        if (!(bm_status & (ATA_BM_STATUS_IRQ | ATA_BM_STATUS_ERR))) {
+            return;
+        }
+        outb(ch->bm_base + ATA_BM_COMMAND, req->write ? 0 : ATA_BM_CMD_READ);
+        outb(ch->bm_base + ATA_BM_STATUS, bm_status | ATA_BM_STATUS_ERR | ATA_BM_STATUS_IRQ);
+    }
+
+    uint8_t status = inb(ch->base + ATA_REG_STATUS);
+    if ((status & ATA_STATUS_BSY) && !req->dma) {
+        return;
+    }
+
+    if ((status & (ATA_STATUS_ERR | ATA_STATUS_DF)) || (bm_status & ATA_BM_STATUS_ERR)) {
+        ata_complete(ch, req, status, -1);
+        return;
+    }
+
+    // После последнего сектора PIO out приходит ещё одно прерывание,
+    // у команд без данных (FLUSH CACHE) - только оно
+    if (req->dma || req->sectors_left == 0) {
+        ata_complete(ch, req, status, 0);
+        return;
+    }
+
+    if (!(status & ATA_STATUS_DRQ)) {
+        ata_complete(ch, req, status, -1);
+        return;
+    }
+
+    // READ/WRITE MULTIPLE: блок до req->block секторов на одно DRQ
+    uint32_t sectors = req->sectors_left < req->block ? req->sectors_left : req->block;
+    size_t bytes = sectors * ATA_SECTOR_SIZE;
+    if (req->write) {
+        if (req->pio32) {
+            outsl(ch->base + ATA_REG_DATA, req->buffer, bytes / 4);
+        } else {
+            outsw(ch->base + ATA_REG_DATA, req->buffer, bytes / 2);
+        }
+    } else {
+        if (req->pio32) {
+            insl(ch->base + ATA_REG_DATA, req->buffer, bytes / 4);
+        } else {
+            insw(ch->base + ATA_REG_DATA, req->buffer, bytes / 2);
+        }
+    }
+    req->buffer += sectors * ATA_SECTOR_SIZE;
+    req->sectors_left -= sectors;
+
+    if (!req->write && req->sectors_left == 0) {
+        ata_complete(ch, req, status, 0);
+    }
+}
+
+static void ata_irq(ata_channel_t *ch) {
+    ata_stats.irqs++;
+    if (!ch->active) {
+        ata_stats.spurious_irqs++;
+    }
+    ata_service(ch);
+}
+
+static void ata_primary_irq(struct registers *regs) {
+    (void)regs;
+    ata_irq(&ata_channels[0]);
+}
+
+static void ata_secondary_irq(struct registers *regs) {
+    (void)regs;
+    ata_irq(&ata_channels[1]);
+}
+
+// С IF=1 ждём в hlt, пока обработчик IRQ не завершит запрос. С IF=0
+// (например, чтение страницы в обработчике #PF) остаётся только опрос
+static int ata_wait(ata_channel_t *ch, ata_request_t *req, uint64_t start) {
+    if (ata_irqs_enabled()) {
+        uint64_t deadline = get_timer_ticks() + ATA_IRQ_TIMEOUT_TICKS;
+        ata_stats.irq_waits++;
+
+        asm volatile("cli");
+        while (!req->done && get_timer_ticks() < deadline) {
+            asm volatile("sti; hlt; cli");
+        }
+        if (!req->done) {
+            ata_service(ch);
+        }
+        asm volatile("sti");
+    } else {
+        ata_stats.poll_waits++;
+        // Без IRQ статус читается сразу за командой или блоком данных,
+        // а BSY/DRQ там ещё прежние - сначала выдерживаем 400 нс
+        ata_settle(ch->control);
+        for (int timeout = ATA_POLL_TIMEOUT; !req->done && timeout > 0; timeout--) {
+            uint32_t left = req->sectors_left;
+            ata_service(ch);
+            if (req->sectors_left != left) {
+                ata_settle(ch->control);
             }
-            timeout--;
         }
-        
-        if (timeout == 0) {
-            printf("ATA Read timeout\n");
-            return -1;
+    }
+
+    if (!req->done) {
+        bool irqs = ata_irqs_enabled();
+        asm volatile("cli");
+        if (req->dma) {
+            outb(ch->bm_base + ATA_BM_COMMAND, req->write ? 0 : ATA_BM_CMD_READ);
         }
-        
-        for (int i = 0; i < 256; i++) {
-            buf[sector * 256 + i] = inw(dev->base + ATA_REG_DATA);
+        ch->active = NULL;
+        ch->selected = 0;
+        req->error = -1;
+        ata_stats.timeouts++;
+        if (irqs) {
+            asm volatile("sti");
         }
-        
-        ata_delay(); 
+        printf("ATA %s timeout\n", req->write ? "write" : "read");
     }
-    
-    return 0;
+
+    uint64_t cycles = rdtsc() - start;
+    ata_stats.requests++;
+    ata_stats.cycles_total += cycles;
+    if (cycles > ata_stats.cycles_max) {
+        ata_stats.cycles_max = cycles;
+    }
+
+    return req->error;
 }
 
-int ata_write_sectors(ata_device_t *dev, uint32_t lba, uint8_t count, const void *buffer) {
-    if (!dev->exists || count == 0) {
+// Запрос становится активным до записи команды: IRQ может прийти сразу после неё
+static int ata_start(ata_device_t *dev, ata_request_t *req, uint64_t lba, uint32_t count, uint8_t command) {
+    ata_channel_t *ch = dev->channel;
+    uint64_t start = rdtsc();
+
+    ata_stats.sectors += count;
+    ata_select_drive(dev, req->lba48 ? 0 : (uint32_t)lba);
+    if (ata_wait_busy(dev) != 0) {
+        printf("ATA busy timeout\n");
         return -1;
     }
-    
-    ata_select_drive(dev, lba);
-    ata_wait_busy(dev);
-    
+
+    bool irqs = ata_irqs_enabled();
+    asm volatile("cli");
+    ch->active = req;
+
+    // LBA48: регистры двухбайтовые FIFO, сначала старшие байты
+    if (req->lba48) {
+        outb(dev->base + ATA_REG_FEATURES, 0);
+        outb(dev->base + ATA_REG_SECCOUNT, (count >> 8) & 0xFF);
+        outb(dev->base + ATA_REG_LBA_LOW, (lba >> 24) & 0xFF);
+        outb(dev->base + ATA_REG_LBA_MID, (lba >> 32) & 0xFF);
+        outb(dev->base + ATA_REG_LBA_HIGH, (lba >> 40) & 0xFF);
+    }
+
     outb(dev->base + ATA_REG_FEATURES, 0);
-    outb(dev->base + ATA_REG_SECCOUNT, count);
+    outb(dev->base + ATA_REG_SECCOUNT, count & 0xFF);
     outb(dev->base + ATA_REG_LBA_LOW, lba & 0xFF);
     outb(dev->base + ATA_REG_LBA_MID, (lba >> 8) & 0xFF);
     outb(dev->base + ATA_REG_LBA_HIGH, (lba >> 16) & 0xFF);
-    
-    outb(dev->base + ATA_REG_COMMAND, ATA_CMD_WRITE_SECTORS);
-    
-    const uint16_t *buf = (const uint16_t *)buffer;
-    
-    for (int sector = 0; sector < count; sector++) {
-        ata_wait_ready(dev);
-        
-        int timeout = 1000000;
-        while (!(ata_get_status(dev) & ATA_STATUS_DRQ) && timeout > 0) {
-            uint8_t status = ata_get_status(dev);
-            if (status & ATA_STATUS_ERR) {
-                uint8_t error = inb(dev->base + ATA_REG_ERROR);
-                if (error != ATA_ERROR_ABRT && error != ATA_ERROR_IDNF) {
-                    printf("ATA Write Error: 0x%02X\n", error);
-                    return -1;
-                }
-                break; 
+    outb(dev->base + ATA_REG_COMMAND, command);
+
+    if (req->dma) {
+        outb(ch->bm_base + ATA_BM_COMMAND, (req->write ? 0 : ATA_BM_CMD_READ) | ATA_BM_CMD_START);
+    } else if (req->write && req->sectors_left > 0) {
+        // Первый сектор PIO out отдаётся по DRQ, прерывания перед ним нет
+        int timeout = ATA_POLL_TIMEOUT;
+        while ((inb(ch->control) & (ATA_STATUS_BSY | ATA_STATUS_DRQ)) != ATA_STATUS_DRQ &&
+               !(inb(ch->control) & ATA_STATUS_ERR) && --timeout > 0);
+        ata_service(ch);
+    }
+
+    if (irqs) {
+        asm volatile("sti");
+    }
+
+    return ata_wait(ch, req, start);
+}
+
+static uint8_t ata_pio_command(ata_device_t *dev, bool lba48, bool write) {
+    if (dev->multiple > 1) {
+        if (lba48) {
+            return write ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE_EXT;
+        }
+        return write ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_READ_MULTIPLE;
+    }
+
+    if (lba48) {
+        return write ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_READ_SECTORS_EXT;
+    }
+    return write ? ATA_CMD_WRITE_SECTORS : ATA_CMD_READ_SECTORS;
+}
+
+static int ata_pio_transfer(ata_device_t *dev, uint64_t lba, uint32_t count, void *buffer, bool write, bool lba48) {
+    ata_request_t req = {
+        .buffer = buffer,
+        .sectors_left = count,
+        .block = dev->multiple,
+        .write = write,
+        .pio32 = dev->pio32,
+        .lba48 = lba48,
+    };
+
+    int ret = ata_start(dev, &req, lba, count, ata_pio_command(dev, lba48, write));
+    if (ret != 0 && !req.done) {
+        return -1;
+    }
+
+    if (ret != 0) {
+        printf("ATA %s error: status 0x%X, error 0x%X\n", write ? "write" : "read",
+               req.status, inb(dev->base + ATA_REG_ERROR));
+    }
+
+    return ret;
+}
+
+// PRD прямо на буфер вызывающего: постранично через virt_to_phys, соседние
+// физические куски сливаются в пределах окна 64 КБ. 0 - буфер не годится для DMA
+static int ata_prdt_direct(ata_channel_t *ch, uintptr_t virt, uint32_t bytes) {
+    if (virt & 3) {
+        return 0;
+    }
+
+    int nr_prd = 0;
+    while (bytes > 0) {
+        uint32_t len = PAGE_SIZE - (virt & ~PAGE_MASK);
+        if (len > bytes) {
+            len = bytes;
+        }
+
+        uintptr_t phys = virt_to_phys(virt);
+        if (!phys || phys + len > ATA_DMA_LIMIT) {
+            return 0;
+        }
+
+        ata_prd_t *prev = nr_prd ? &ch->prdt[nr_prd - 1] : NULL;
+        uint32_t prev_len = prev ? (prev->count ? prev->count : ATA_PRD_MAX_BYTES) : 0;
+        if (prev && prev->addr + prev_len == phys &&
+            (prev->addr & ~(ATA_PRD_MAX_BYTES - 1)) == ((phys + len - 1) & ~(ATA_PRD_MAX_BYTES - 1))) {
+            prev->count = (uint16_t)(prev_len + len);
+        } else {
+            if (nr_prd == ATA_PRDT_ENTRIES) {
+                return 0;
             }
-            timeout--;
+            ch->prdt[nr_prd].addr = (uint32_t)phys;
+            ch->prdt[nr_prd].count = (uint16_t)len;
+            ch->prdt[nr_prd].flags = 0;
+            nr_prd++;
         }
-        
-        if (timeout == 0) {
-            printf("ATA Write timeout\n");
-            return -1;
+
+        virt += len;
+        bytes -= len;
+    }
+
+    return nr_prd;
+}
+
+// Буфер канала - только запасной путь, если буфер вызывающего выше 4 ГБ или не выровнен
+static int ata_dma_transfer(ata_device_t *dev, uint64_t lba, uint32_t count, void *buffer, bool write, bool lba48) {
+    ata_channel_t *ch = dev->channel;
+    uint32_t bytes = count * ATA_SECTOR_SIZE;
+
+    int nr_prd = ata_prdt_direct(ch, (uintptr_t)buffer, bytes);
+    bool bounce = nr_prd == 0;
+    if (bounce) {
+        ata_stats.dma_bounces++;
+        if (write) {
+            memcpy(ch->dma_buf, buffer, bytes);
         }
-        
-        for (int i = 0; i < 256; i++) {
-            outw(dev->base + ATA_REG_DATA, buf[sector * 256 + i]);
+
+        for (uint32_t off = 0; off < bytes; off += ATA_PRD_MAX_BYTES) {
+            uint32_t len = bytes - off < ATA_PRD_MAX_BYTES ? bytes - off : ATA_PRD_MAX_BYTES;
+            ch->prdt[nr_prd].addr = ch->dma_buf_phys + off;
+            ch->prdt[nr_prd].count = (uint16_t)len;
+            ch->prdt[nr_prd].flags = 0;
+            nr_prd++;
         }
-        
-        ata_delay();
+    } else {
+        ata_stats.dma_direct++;
+    }
+    ch->prdt[nr_prd - 1].flags = ATA_PRD_EOT;
+
+    outb(ch->bm_base + ATA_BM_COMMAND, write ? 0 : ATA_BM_CMD_READ);
+    outl(ch->bm_base + ATA_BM_PRDT, ch->prdt_phys);
+    outb(ch->bm_base + ATA_BM_STATUS, inb(ch->bm_base + ATA_BM_STATUS) | ATA_BM_STATUS_ERR | ATA_BM_STATUS_IRQ);
+
+    ata_request_t req = {
+        .write = write,
+        .dma = true,
+        .lba48 = lba48,
+    };
+
+    uint8_t command;
+    if (lba48) {
+        command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    } else {
+        command = write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+    }
+
+    if (ata_start(dev, &req, lba, count, command) != 0) {
+        if (!req.done) {
+            printf("ATA DMA timeout, falling back to PIO\n");
+            dev->dma = false;
+        } else {
+            printf("ATA DMA error: status 0x%X, error 0x%X\n", req.status, inb(dev->base + ATA_REG_ERROR));
+        }
+        return -1;
+    }
+
+    if (bounce && !write) {
+        memcpy(buffer, ch->dma_buf, bytes);
+    }
+
+    return 0;
+}
+
+// Длинный запрос режется на команды: DMA ограничен буфером канала,
+// PIO - 256 секторами для LBA28 и 65536 для LBA48
+static int ata_transfer(ata_device_t *dev, uint64_t lba, uint32_t count, uint8_t *buffer, bool write) {
+    if (dev->sectors && lba + count > dev->sectors) {
+        printf("ATA: LBA %lld + %d beyond end of device\n", (long long)lba, count);
+        return -1;
+    }
+
+    if (!dev->lba48 && lba + count > ATA_LBA28_LIMIT) {
+        return -1;
+    }
+
+    while (count > 0) {
+        uint32_t max = dev->lba48 ? ATA_LBA48_MAX_SECTORS : ATA_LBA28_MAX_SECTORS;
+        if (dev->dma) {
+            max = ATA_DMA_MAX_SECTORS;
+        }
+
+        uint32_t n = count < max ? count : max;
+        bool lba48 = lba + n > ATA_LBA28_LIMIT || n > ATA_LBA28_MAX_SECTORS;
+
+        if (!dev->dma || ata_dma_transfer(dev, lba, n, buffer, write, lba48) != 0) {
+            if (ata_pio_transfer(dev, lba, n, buffer, write, lba48) != 0) {
+                return -1;
+            }
+        }
+
+        lba += n;
+        count -= n;
+        buffer += n * ATA_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+int ata_read_sectors(ata_device_t *dev, uint64_t lba, uint32_t count, void *buffer) {
+    if (!dev->exists || count == 0) {
+        printf("dev exists: %d, count: %d", dev->exists, count);
+        return -1;
+    }
+
+    return ata_transfer(dev, lba, count, buffer, false);
+}
+
+int ata_write_sectors(ata_device_t *dev, uint64_t lba, uint32_t count, const void *buffer) {
+    if (!dev->exists || count == 0) {
+        return -1;
+    }
+
+    if (ata_transfer(dev, lba, count, (uint8_t *)buffer, true) != 0) {
+        return -1;
     }
     
-    outb(dev->base + ATA_REG_COMMAND, ATA_CMD_FLUSH_CACHE);
-    ata_wait_ready(dev);
+    if (dev->write_through) {
+        return ata_flush(dev);
+    }
     
     return 0;
 }
 
+// Барьер: всё, что ata_write_sectors вернул, после него лежит на носителе
+int ata_flush(ata_device_t *dev) {
+    if (!dev->exists) {
+        return -1;
+    }
+
+    ata_request_t req = {
+        .lba48 = dev->lba48,
+    };
+
+    ata_stats.flushes++;
+    int ret = ata_start(dev, &req, 0, 0, dev->lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+    if (ret != 0 && req.done) {
+        printf("ATA flush error: status 0x%X, error 0x%X\n", req.status, inb(dev->base + ATA_REG_ERROR));
+    }
+
+    return ret;
+}
+
 void ata_reset_controller(uint16_t base) {
+    for (int i = 0; i < 2; i++) {
+        if (ata_channels[i].base == base) {
+            ata_channels[i].selected = 0;
+        }
+    }
+    
     outb(base + ATA_REG_CONTROL, 0x04);
     ata_long_delay();
     
@@ -256,6 +657,18 @@ int ata_init(void) {
     
     memset(ata_devices, 0, sizeof(ata_devices));
     
+    ata_channels[0].base = ATA_PRIMARY_BASE;
+    ata_channels[0].control = ATA_PRIMARY_BASE + ATA_REG_CONTROL;
+    ata_channels[1].base = ATA_SECONDARY_BASE;
+    ata_channels[1].control = ATA_SECONDARY_BASE + ATA_REG_CONTROL;
+    
+    for (int i = 0; i < 4; i++) {
+        ata_devices[i].channel = &ata_channels[i / 2];
+    }
+    
+    register_irq_handler(14, ata_primary_irq);
+    register_irq_handler(15, ata_secondary_irq);
+    
     ata_devices[0].base = ATA_PRIMARY_BASE;
     ata_devices[0].control = ATA_PRIMARY_BASE + ATA_REG_CONTROL;
     ata_devices[0].drive = 0;
@@ -276,6 +689,9 @@ int ata_init(void) {
     for (int i = 0; i < 4; i++) {
         printf("Checking ATA device %d...\n", i);
         if (ata_identify(&ata_devices[i]) == 0) {
+            if (ata_set_multiple(&ata_devices[i]) == 0) {
+                printf("ATA device %d: %d sectors per interrupt\n", i, ata_devices[i].multiple);
+            }
             found_devices++;
         } else {
             printf("ATA device %d not found\n", i);
@@ -283,9 +699,222 @@ int ata_init(void) {
     }
     
     printf("Found %d ATA device(s)\n", found_devices);
+    
+    if (found_devices > 0) {
+        ata_dma_init();
+    }
+    
     return found_devices;
 }
 
+// SET FEATURES / Set transfer mode: лучший UDMA, иначе Multiword DMA
+static int ata_set_dma_mode(ata_device_t *dev) {
+    uint8_t mode;
+    if (dev->udma_mode >= 0) {
+        mode = ATA_XFER_UDMA | dev->udma_mode;
+    } else if (dev->mdma_mode >= 0) {
+        mode = ATA_XFER_MDMA | dev->mdma_mode;
+    } else {
+        return -1;
+    }
+
+    ata_select_drive(dev, 0);
+    ata_wait_busy(dev);
+
+    outb(dev->base + ATA_REG_FEATURES, ATA_FEATURE_XFER_MODE);
+    outb(dev->base + ATA_REG_SECCOUNT, mode);
+    outb(dev->base + ATA_REG_COMMAND, ATA_CMD_SET_FEATURES);
+    ata_delay();
+    ata_wait_busy(dev);
+
+    if (ata_get_status(dev) & (ATA_STATUS_ERR | ATA_STATUS_DF)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int ata_channel_dma_init(ata_channel_t *ch) {
+    if (ch->dma_buf) {
+        return 0;
+    }
+
+    ch->prdt = alloc_pages(GFP_DMA32 | GFP_ZERO, 0);
+    ch->dma_buf = alloc_pages(GFP_DMA32, ATA_DMA_BUF_ORDER);
+    if (!ch->prdt || !ch->dma_buf) {
+        if (ch->prdt) page_free(ch->prdt, 0);
+        if (ch->dma_buf) page_free(ch->dma_buf, ATA_DMA_BUF_ORDER);
+        ch->prdt = NULL;
+        ch->dma_buf = NULL;
+        return -1;
+    }
+
+    ch->prdt_phys = (uint32_t)virt_to_phys((uintptr_t)ch->prdt);
+    ch->dma_buf_phys = (uint32_t)virt_to_phys((uintptr_t)ch->dma_buf);
+    return 0;
+}
+
+// Контроллеры, которые сами собирают 32-битное обращение к порту данных из двух 16-битных
+static const struct {
+    uint16_t vendor_id;
+    uint16_t device_id;
+} ata_pio32_controllers[] = {
+    { 0x8086, 0x1230 },     // PIIX
+    { 0x8086, 0x7010 },     // PIIX3
+    { 0x8086, 0x7111 },     // PIIX4
+    { 0x8086, 0x2411 },     // ICH
+    { 0x8086, 0x244B },     // ICH2
+    { 0x8086, 0x24CB },     // ICH4
+    { 0x8086, 0x24DB },     // ICH5
+    { 0x8086, 0x266F },     // ICH6
+    { 0x8086, 0x27DF },     // ICH7
+};
+
+static bool ata_pio32_capable(const pci_device_t *ide) {
+    for (size_t i = 0; i < sizeof(ata_pio32_controllers) / sizeof(ata_pio32_controllers[0]); i++) {
+        if (ide->vendor_id == ata_pio32_controllers[i].vendor_id &&
+            ide->device_id == ata_pio32_controllers[i].device_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ata_set_pio32(ata_device_t *dev, bool enable) {
+    if (dev) {
+        dev->pio32 = enable;
+    }
+}
+
+int ata_dma_init(void) {
+    pci_device_t *ide = pci_get_device_by_class(0x01, 0x01, 0xFF);
+    if (!ide) {
+        printf("ATA: no PCI IDE controller, using PIO\n");
+        return -1;
+    }
+
+    // Порты 0x1F0/0x170 принадлежат этому контроллеру, только если он не в native режиме
+    if (!(ide->prog_if & 0x05) && ata_pio32_capable(ide)) {
+        for (int i = 0; i < 4; i++) {
+            ata_devices[i].pio32 = ata_devices[i].exists;
+        }
+        printf("ATA: controller %X:%X, 32-bit PIO\n", ide->vendor_id, ide->device_id);
+    }
+
+    // prog_if бит 7 - bus master; биты 0 и 2 - native режим, в нём порты не 0x1F0/0x170
+    uint32_t bar4 = pci_get_bar(ide, 4);
+    if (!(ide->prog_if & 0x80) || (ide->prog_if & 0x05) || !(bar4 & 1)) {
+        printf("ATA: bus master DMA unavailable (prog_if 0x%X), using PIO\n", ide->prog_if);
+        return -1;
+    }
+
+    pci_enable_io_space(ide);
+    pci_enable_bus_mastering(ide);
+
+    uint16_t bm_base = bar4 & 0xFFFC;
+    int dma_devices = 0;
+
+    for (int i = 0; i < 4; i++) {
+        ata_device_t *dev = &ata_devices[i];
+        ata_channel_t *ch = dev->channel;
+
+        ch->bm_base = bm_base + (i / 2) * ATA_BM_CHANNEL_SIZE;
+        if (!dev->exists) {
+            continue;
+        }
+
+        if (ata_channel_dma_init(ch) != 0 || ata_set_dma_mode(dev) != 0) {
+            printf("ATA Device %d: DMA setup failed, using PIO\n", i);
+            continue;
+        }
+
+        dev->dma = true;
+        outb(ch->bm_base + ATA_BM_STATUS, inb(ch->bm_base + ATA_BM_STATUS) |
+             (dev->drive == 0 ? ATA_BM_STATUS_DRV0 : ATA_BM_STATUS_DRV1));
+        dma_devices++;
+
+        if (dev->udma_mode >= 0) {
+            printf("ATA Device %d: UDMA%d\n", i, dev->udma_mode);
+        } else {
+            printf("ATA Device %d: MWDMA%d\n", i, dev->mdma_mode);
+        }
+    }
+
+    return dma_devices;
+}
+
+void ata_get_stats(ata_stats_t *stats) {
+    *stats = ata_stats;
+}
+
+void ata_dump_stats(void) {
+    printf("ATA requests: %lld, %lld sectors (irq wait %lld, poll %lld, timeouts %lld)\n",
+           (long long)ata_stats.requests, (long long)ata_stats.sectors, (long long)ata_stats.irq_waits,
+           (long long)ata_stats.poll_waits, (long long)ata_stats.timeouts);
+    printf("ATA irqs: %lld, spurious %lld\n",
+           (long long)ata_stats.irqs, (long long)ata_stats.spurious_irqs);
+    printf("ATA cache flushes: %lld\n", (long long)ata_stats.flushes);
+    printf("ATA DMA: %lld direct, %lld bounced\n",
+           (long long)ata_stats.dma_direct, (long long)ata_stats.dma_bounces);
+    printf("ATA drive select: %lld skipped, %lld written\n",
+           (long long)ata_stats.select_hits, (long long)ata_stats.select_misses);
+    if (ata_stats.requests) {
+        printf("ATA completion cycles: avg %lld, max %lld\n",
+               (long long)(ata_stats.cycles_total / ata_stats.requests),
+               (long long)ata_stats.cycles_max);
+    }
+}
+
+// Односекторные чтения подряд, как их делает PROS: старый выбор устройства
+// (запись регистра + 4000 чтений ALTSTATUS), новый без кэша и новый с кэшем
+void ata_bench(ata_device_t *dev) {
+    if (!dev || !dev->exists) {
+        printf("ATA bench: no device\n");
+        return;
+    }
+
+    uint8_t *buf = kmalloc(ATA_SECTOR_SIZE);
+    if (!buf) {
+        return;
+    }
+
+    static const char *names[] = { "legacy select", "settle + BSY", "cached select" };
+    uint64_t select_cycles[3] = {0}, cmd_cycles[3] = {0};
+
+    for (int mode = 0; mode < 3; mode++) {
+        for (int i = 0; i < ATA_BENCH_COMMANDS; i++) {
+            uint64_t start = rdtsc();
+            if (mode == 0) {
+                uint8_t drive_reg = (dev->drive == 0 ? ATA_DRIVE_MASTER : ATA_DRIVE_SLAVE) | ATA_DRIVE_LBA;
+                outb(dev->base + ATA_REG_DRIVE, drive_reg);
+                ata_long_delay();
+                dev->channel->selected = drive_reg;
+            } else if (mode == 1) {
+                dev->channel->selected = 0;
+            }
+            ata_select_drive(dev, i);
+            uint64_t selected = rdtsc();
+
+            if (ata_read_sectors(dev, i, 1, buf) != 0) {
+                printf("ATA bench: read failed\n");
+                kfree(buf);
+                return;
+            }
+
+            select_cycles[mode] += selected - start;
+            cmd_cycles[mode] += rdtsc() - start;
+        }
+    }
+
+    for (int mode = 0; mode < 3; mode++) {
+        printf("%s: select %lld, command %lld cycles\n", names[mode],
+               (long long)(select_cycles[mode] / ATA_BENCH_COMMANDS),
+               (long long)(cmd_cycles[mode] / ATA_BENCH_COMMANDS));
+    }
+
+    kfree(buf);
+}
+
 ata_device_t* get_ata_device(int drive) {
     if (drive >= 0 && drive < 2) {
         return &ata_devices[drive];
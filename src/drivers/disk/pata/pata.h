@@ -2,6 +2,7 @@
 #define ATA_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define ATA_PRIMARY_BASE    0x1F0
 #define ATA_SECONDARY_BASE  0x170
@@ -42,30 +43,141 @@
 #define ATA_CMD_WRITE_SECTORS   0x30
 #define ATA_CMD_IDENTIFY        0xEC
 #define ATA_CMD_FLUSH_CACHE     0xE7
+#define ATA_CMD_READ_DMA        0xC8
+#define ATA_CMD_WRITE_DMA       0xCA
+#define ATA_CMD_READ_MULTIPLE   0xC4
+#define ATA_CMD_WRITE_MULTIPLE  0xC5
+#define ATA_CMD_SET_MULTIPLE    0xC6
+#define ATA_CMD_READ_SECTORS_EXT    0x24
+#define ATA_CMD_READ_DMA_EXT        0x25
+#define ATA_CMD_READ_MULTIPLE_EXT   0x29
+#define ATA_CMD_WRITE_SECTORS_EXT   0x34
+#define ATA_CMD_WRITE_DMA_EXT       0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT  0x39
+#define ATA_CMD_FLUSH_CACHE_EXT     0xEA
+#define ATA_CMD_SET_FEATURES    0xEF
+
+#define ATA_FEATURE_XFER_MODE   0x03
+#define ATA_XFER_MDMA           0x20
+#define ATA_XFER_UDMA           0x40
+
+// Bus master IDE (PCI BAR4), регистры вторичного канала сдвинуты на 8
+#define ATA_BM_COMMAND      0x00
+#define ATA_BM_STATUS       0x02
+#define ATA_BM_PRDT         0x04
+#define ATA_BM_CHANNEL_SIZE 0x08
+
+#define ATA_BM_CMD_START    0x01
+#define ATA_BM_CMD_READ     0x08
+
+#define ATA_BM_STATUS_ACTIVE 0x01
+#define ATA_BM_STATUS_ERR    0x02
+#define ATA_BM_STATUS_IRQ    0x04
+#define ATA_BM_STATUS_DRV0   0x20
+#define ATA_BM_STATUS_DRV1   0x40
+
+#define ATA_PRD_EOT         0x8000
+#define ATA_PRD_MAX_BYTES   0x10000
+#define ATA_DMA_BUF_ORDER   5           // 128 КБ
+#define ATA_DMA_MAX_SECTORS 256
+#define ATA_DMA_LIMIT       0x100000000UL   // PRD адресует только первые 4 ГБ
+#define ATA_PRDT_ENTRIES    512             // PRDT занимает одну страницу
+#define ATA_POLL_TIMEOUT    10000000
+#define ATA_IRQ_TIMEOUT_TICKS 500       // 5 с при таймере 100 Гц
+#define ATA_BENCH_COMMANDS  64
 
 #define ATA_DRIVE_MASTER    0xA0
 #define ATA_DRIVE_SLAVE     0xB0
+#define ATA_DRIVE_LBA       0x40
 
 #define ATA_SECTOR_SIZE     512
 
+#define ATA_LBA28_LIMIT         (1ULL << 28)
+#define ATA_LBA28_MAX_SECTORS   256
+#define ATA_LBA48_MAX_SECTORS   65536
+
+typedef struct {
+    uint32_t addr;
+    uint16_t count;         // 0 означает 64 КБ
+    uint16_t flags;
+} __attribute__((packed)) ata_prd_t;
+
+// Запрос в полёте; IRQ-обработчик канала продвигает его посекторно
+typedef struct {
+    uint8_t *buffer;
+    uint32_t sectors_left;
+    uint16_t block;         // секторов на одно DRQ
+    uint8_t status;
+    bool write;
+    bool dma;
+    bool lba48;
+    bool pio32;
+    volatile bool done;
+    int error;
+} ata_request_t;
+
+typedef struct {
+    uint16_t base;
+    uint16_t control;
+    uint16_t bm_base;       // 0 - bus master недоступен
+    ata_prd_t *prdt;
+    uint32_t prdt_phys;
+    uint8_t *dma_buf;       // буфер ниже 4 ГБ, PRD не пересекают границу 64 КБ
+    uint32_t dma_buf_phys;
+    ata_request_t *volatile active;
+    uint8_t selected;       // последнее значение регистра устройства, 0 - неизвестно
+} ata_channel_t;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t sectors;
+    uint64_t irq_waits;         // ожидание в hlt до IRQ
+    uint64_t poll_waits;        // IF=0, опрос статуса
+    uint64_t timeouts;
+    uint64_t flushes;
+    uint64_t dma_direct;        // PRD на буфер вызывающего
+    uint64_t dma_bounces;       // через буфер канала
+    uint64_t irqs;
+    uint64_t spurious_irqs;     // IRQ без активного запроса
+    uint64_t select_hits;       // устройство уже было выбрано
+    uint64_t select_misses;
+    uint64_t cycles_total;      // от выбора устройства до завершения, rdtsc
+    uint64_t cycles_max;
+} ata_stats_t;
+
 typedef struct {
     uint16_t base;       
     uint16_t control;    
     uint8_t drive;       
     uint8_t exists;      
     char model[41];      
-    uint32_t sectors;    
+    uint64_t sectors;    
+    bool lba48;
+    bool pio32;             // порт данных читается по 32 бита: известный контроллер или ata_set_pio32
+    uint8_t max_multiple;   // IDENTIFY слово 47
+    uint8_t multiple;       // текущий SET MULTIPLE, 1 - обычные READ/WRITE SECTORS
+    ata_channel_t *channel;
+    int8_t udma_mode;       // -1 - не поддерживается
+    int8_t mdma_mode;
+    bool dma;
+    bool write_through;     // FLUSH CACHE после каждой записи
 } ata_device_t;
 
 int ata_init(void);
 int ata_identify(ata_device_t *dev);
-int ata_read_sectors(ata_device_t *dev, uint32_t lba, uint8_t count, void *buffer);
-int ata_write_sectors(ata_device_t *dev, uint32_t lba, uint8_t count, const void *buffer);
-void ata_wait_busy(ata_device_t *dev);
+int ata_read_sectors(ata_device_t *dev, uint64_t lba, uint32_t count, void *buffer);
+int ata_write_sectors(ata_device_t *dev, uint64_t lba, uint32_t count, const void *buffer);
+int ata_flush(ata_device_t *dev);
+int ata_wait_busy(ata_device_t *dev);
 int ata_wait_ready(ata_device_t *dev);
 uint8_t ata_get_status(ata_device_t *dev);
 void ata_select_drive(ata_device_t *dev, uint32_t lba);
 void ata_reset_controller(uint16_t base);
+int ata_dma_init(void);
+void ata_set_pio32(ata_device_t *dev, bool enable);
+void ata_get_stats(ata_stats_t *stats);
+void ata_dump_stats(void);
+void ata_bench(ata_device_t *dev);
 
 extern ata_device_t ata_devices[4];
 extern ata_device_t* get_ata_device(int drive);
@@ -15,7 +15,7 @@ static uint32_t pci_make_address(uint8_t bus, uint8_t device, uint8_t function,
 }
 
 static pci_device_t* pci_add_device(uint8_t bus, uint8_t device, uint8_t function) {
-    pci_device_t* dev = (pci_device_t*)kmalloc(sizeof(pci_device_t));
+    pci_device_t* dev = (pci_device_t*)kmalloc_tag(sizeof(pci_device_t), MM_TAG_PCI);
     if (!dev) return NULL;
     
     memset(dev, 0, sizeof(pci_device_t));
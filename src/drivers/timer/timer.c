@@ -1,6 +1,7 @@
 #include "timer.h"
 #include <asm/io.h>
 #include "../../kernel/idt/idt.h"
+#include "../../kernel/mm/mem.h"
 
 #define PIT_FREQUENCY 1193180
 #define PIT_COMMAND_PORT 0x43
@@ -29,6 +30,7 @@ uint64_t get_timer_ticks() {
 void Sleep(uint64_t milliseconds) {
     uint64_t end_ticks = timer_ticks + milliseconds;
     while (timer_ticks < end_ticks) {
+        mm_idle();
         asm volatile("sti; hlt; cli");
     }
 
@@ -5,5 +5,6 @@
 
 void init_timer(uint32_t frequency);
 void Sleep(uint64_t milliseconds);
+uint64_t get_timer_ticks(void);
 
 #endif
\ No newline at end of file
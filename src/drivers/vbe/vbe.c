@@ -580,17 +580,16 @@ int init_lfb() {
     uintptr_t fb_phys_aligned = fb_phys & PAGE_MASK;
     size_t fb_size = screen_width * screen_height * sizeof(uint32_t);
     uintptr_t fb_end = fb_phys + fb_size;
-    size_t page_count = (fb_end - fb_phys_aligned + PAGE_SIZE - 1) / PAGE_SIZE;
     uintptr_t fb_virt = 0xFFFF800000000000 + 0x1000000;
     
-    if (map_pages(fb_virt, fb_phys_aligned, page_count, PAGE_PRESENT | PAGE_WRITABLE) != 0) {
+    if (map_range(fb_virt, fb_phys_aligned, fb_end - fb_phys_aligned, PAGE_PRESENT | PAGE_WRITABLE) != 0) {
         return -1;
     }
     
     fb = (uint32_t*)(fb_virt + (fb_phys - fb_phys_aligned));
     pitch = screen_width * sizeof(uint32_t);
     
-    back_buffer = (uint32_t*)kmalloc(screen_width * screen_height * sizeof(uint32_t));
+    back_buffer = (uint32_t*)kmalloc_tag(screen_width * screen_height * sizeof(uint32_t), MM_TAG_VBE);
     if (!back_buffer) return -2;
     
     memsetfast(dirty_regions, 0, sizeof(dirty_regions));
@@ -28,4 +28,20 @@ uint32_t inl(uint16_t port) {
     uint32_t ret;
     asm volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
     return ret;
+}
+
+void insw(uint16_t port, void *buffer, size_t count) {
+    asm volatile ("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+void outsw(uint16_t port, const void *buffer, size_t count) {
+    asm volatile ("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+void insl(uint16_t port, void *buffer, size_t count) {
+    asm volatile ("rep insl" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+void outsl(uint16_t port, const void *buffer, size_t count) {
+    asm volatile ("rep outsl" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
 }
\ No newline at end of file
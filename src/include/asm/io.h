@@ -2,6 +2,7 @@
 #define IO_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 void outb(uint16_t port, uint8_t value);
 uint8_t inb(uint16_t port);
@@ -12,4 +13,15 @@ uint16_t inw(uint16_t port);
 void outl(uint16_t port, uint32_t value);
 uint32_t inl(uint16_t port);
 
+void insw(uint16_t port, void *buffer, size_t count);
+void outsw(uint16_t port, const void *buffer, size_t count);
+void insl(uint16_t port, void *buffer, size_t count);
+void outsl(uint16_t port, const void *buffer, size_t count);
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 #endif // IO_H
\ No newline at end of file
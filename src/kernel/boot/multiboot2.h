@@ -38,11 +38,33 @@ struct multiboot_tag_framebuffer {
     uint8_t reserved;
 };
 
+struct multiboot_mmap_entry {
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+    uint32_t zero;
+};
+
+struct multiboot_tag_mmap {
+    uint32_t type;
+    uint32_t size;
+    uint32_t entry_size;
+    uint32_t entry_version;
+    struct multiboot_mmap_entry entries[];
+};
+
 // Константы Multiboot2
 #define MULTIBOOT2_BOOTLOADER_MAGIC 0x36d76289
 #define MULTIBOOT_TAG_TYPE_FRAMEBUFFER 8
+#define MULTIBOOT_TAG_TYPE_MMAP 6
 #define MULTIBOOT_TAG_TYPE_END 0
 
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+#define MULTIBOOT_MEMORY_RESERVED 2
+#define MULTIBOOT_MEMORY_ACPI_RECLAIMABLE 3
+#define MULTIBOOT_MEMORY_NVS 4
+#define MULTIBOOT_MEMORY_BADRAM 5
+
 /**
  * @brief Получает информацию о фреймбуфере из структуры Multiboot2
  * 
@@ -103,4 +125,42 @@ static inline uint32_t* get_framebuffer_address(uint32_t magic, void* mbi) {
     return fb_info ? fb_info->address : NULL;
 }
 
+/**
+ * @brief Получает карту памяти из структуры Multiboot2
+ * 
+ * @param magic Магическое число Multiboot2
+ * @param mbi Указатель на структуру Multiboot2 information
+ * @return Указатель на тег карты памяти или NULL если не найден
+ */
+static inline struct multiboot_tag_mmap* get_memory_map(uint32_t magic, void* mbi) {
+    if (magic != MULTIBOOT2_BOOTLOADER_MAGIC) {
+        return NULL;
+    }
+    
+    uint8_t* current_tag = (uint8_t*)mbi + sizeof(struct multiboot_header);
+    
+    while (1) {
+        struct multiboot_tag* tag = (struct multiboot_tag*)current_tag;
+        
+        if (tag->type == MULTIBOOT_TAG_TYPE_END) {
+            break;
+        }
+        
+        if (tag->type == MULTIBOOT_TAG_TYPE_MMAP) {
+            return (struct multiboot_tag_mmap*)tag;
+        }
+        
+        current_tag += (tag->size + 7) & ~7;
+    }
+    
+    return NULL;
+}
+
+/**
+ * @brief Возвращает размер структуры Multiboot2 information в байтах
+ */
+static inline uint32_t get_multiboot_info_size(void* mbi) {
+    return ((struct multiboot_header*)mbi)->total_size;
+}
+
 #endif // FRAMEBUFFER_H
\ No newline at end of file
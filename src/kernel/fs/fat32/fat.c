@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include "../../mm/arena.h"
 
 #define MIN_CLUSTERS 65525
 #define ENTRY_FREE 0xE5
@@ -13,6 +14,8 @@
 #define MAX_LONG_FILENAME 255
 #define MAX_CLUSTER_CHAIN 65536
 
+static arena_t fat_arena;
+
 static int is_valid_cluster(fat32_fs_t* fs, uint32_t cluster) {
     if (!fs || !fs->device || cluster < 2 || cluster >= fs->TotalClusters + 2) {
         return 0;
@@ -83,30 +86,29 @@ static uint32_t find_path_cluster(fat32_fs_t* fs, const char* path, uint32_t sta
         return fs->bs.BPB_RootClus;
     }
 
-    char* path_copy = strdup(path);
-    if (!path_copy) {
+    // Копия пути и буфер кластера живут только до выхода из функции
+    arena_mark_t mark = arena_mark(&fat_arena);
+    size_t path_len = strlen(path) + 1;
+    uint32_t bytes_per_cluster = fs->BytesPerCluster;
+    char* path_copy = arena_alloc(&fat_arena, path_len);
+    uint8_t* cluster_data = arena_alloc(&fat_arena, bytes_per_cluster);
+    if (!path_copy || !cluster_data) {
+        arena_rewind(&fat_arena, mark);
         return 0;
     }
+    memcpy(path_copy, path, path_len);
 
     char* token = strtok(path_copy, "/\\");
     uint32_t current_cluster = start_cluster;
 
     while (token != NULL) {
         if (!is_valid_cluster(fs, current_cluster)) {
-            free(path_copy);
-            return 0;
-        }
-
-        uint32_t bytes_per_cluster = fs->BytesPerCluster;
-        uint8_t* cluster_data = malloc(bytes_per_cluster);
-        if (!cluster_data) {
-            free(path_copy);
+            arena_rewind(&fat_arena, mark);
             return 0;
         }
 
         if (read_cluster_chain(fs, current_cluster, cluster_data, bytes_per_cluster) != 0) {
-            free(cluster_data);
-            free(path_copy);
+            arena_rewind(&fat_arena, mark);
             return 0;
         }
 
@@ -212,17 +214,15 @@ static uint32_t find_path_cluster(fat32_fs_t* fs, const char* path, uint32_t sta
             }
         }
 
-        free(cluster_data);
-
         if (!found) {
-            free(path_copy);
+            arena_rewind(&fat_arena, mark);
             return 0;
         }
 
         token = strtok(NULL, "/\\");
     }
 
-    free(path_copy);
+    arena_rewind(&fat_arena, mark);
     return current_cluster;
 }
 
@@ -289,7 +289,7 @@ int fat32_format(ata_device_t* dev) {
         return -1;
     }
 
-    uint32_t* fat = malloc(fat_size * 512);
+    uint32_t* fat = kmalloc_tag(fat_size * 512, MM_TAG_FAT);
     if (!fat) {
         return -1;
     }
@@ -310,7 +310,7 @@ int fat32_format(ata_device_t* dev) {
     }
 
     free(fat);
-    return 0;
+    return ata_flush(dev);
 }
 
 int fat32_init(ata_device_t* dev, fat32_fs_t* fs) {
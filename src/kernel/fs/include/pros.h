@@ -17,6 +17,8 @@
 #define PROS_FAT_ENTRY_EOF 0xFFFFFFFF
 #define PROS_FAT_ENTRY_BAD 0xFFFFFFFE
 #define PROS_MAX_FILES 128
+
+#define PROS_MOUNT_WRITE_THROUGH 0x01
 #define PROS_DIR_ENTRY_EMPTY 0x00
 #define PROS_DIR_ENTRY_DELETED 0xE5
 
@@ -66,6 +68,7 @@ typedef struct {
 
 int pros_format(ata_device_t *dev);
 int pros_init(ata_device_t *dev);
+int pros_mount(ata_device_t *dev, uint32_t flags);
 int pros_create_file(const char *name, uint8_t attributes);
 int pros_rename_file(const char *old_name, const char *new_name);
 int pros_write_file(const char *name, const void *data, size_t size, uint32_t offset);
@@ -86,6 +89,10 @@ int pros_get_free_space(uint64_t *free_bytes);
 int pros_get_total_space(uint64_t *total_bytes);
 int pros_defragment(void);
 
+void *pros_mmap(const char *name, uint32_t offset, size_t len);
+int pros_msync(void *addr, size_t len);
+int pros_munmap(void *addr);
+
 uint32_t pros_cluster_to_lba(uint32_t cluster);
 uint32_t pros_find_free_cluster(void);
 int pros_update_fat(uint32_t cluster, uint32_t value);
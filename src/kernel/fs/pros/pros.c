@@ -3,14 +3,40 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "../../mm/arena.h"
+#include "../../mm/vmalloc.h"
+#include "../../mm/pagecache.h"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+#define PROS_MAX_MAPPINGS 16
+#define PROS_PAGE_SECTORS (PAGE_SIZE / PROS_SECTOR_SIZE)
+
+// Кэш страниц одного файла; живёт, пока файл отображён или его страницы в кэше
+typedef struct {
+    address_space_t mapping;
+    uint32_t start_cluster;
+    uint64_t size;
+    uint32_t *chain;
+    uint32_t nr_clusters;
+    unsigned int users;
+    bool dead;              // файл удалён или обрезан, страницы больше не пишутся
+} pros_mapping_t;
+
+typedef struct {
+    pros_mapping_t *file;
+    unsigned long pgoff;
+} pros_vma_t;
+
 ata_device_t *current_device = NULL;
 pros_boot_sector_t boot_sector;
 pros_file_t open_files[PROS_MAX_FILES];
 
+// Буферы, живущие до конца одной операции ФС
+static arena_t pros_arena;
+static pros_mapping_t pros_mappings[PROS_MAX_MAPPINGS];
+
 uint32_t pros_cluster_to_lba(uint32_t cluster) {
     if (cluster < 2 || cluster >= boot_sector.cluster_count + 2) {
         return 0;
@@ -21,7 +47,8 @@ uint32_t pros_cluster_to_lba(uint32_t cluster) {
 uint32_t pros_find_free_cluster(void) {
     uint32_t fat_sector = boot_sector.fat_start;
     uint32_t fat_entries_per_sector = PROS_SECTOR_SIZE / sizeof(uint32_t);
-    uint32_t *fat_buffer = malloc(PROS_SECTOR_SIZE);
+    arena_mark_t mark = arena_mark(&pros_arena);
+    uint32_t *fat_buffer = arena_alloc(&pros_arena, PROS_SECTOR_SIZE);
     
     if (!fat_buffer) {
         return 0;
@@ -29,7 +56,7 @@ uint32_t pros_find_free_cluster(void) {
     
     for (uint32_t i = 0; i < boot_sector.fat_size_sectors; i++) {
         if (ata_read_sectors(current_device, fat_sector + i, 1, fat_buffer) != 0) {
-            free(fat_buffer);
+            arena_rewind(&pros_arena, mark);
             return 0;
         }
         
@@ -37,14 +64,14 @@ uint32_t pros_find_free_cluster(void) {
             uint32_t cluster_index = j + i * fat_entries_per_sector;
             if (cluster_index >= 2 && cluster_index < boot_sector.cluster_count + 2) {
                 if (fat_buffer[j] == PROS_FAT_ENTRY_FREE) {
-                    free(fat_buffer);
+                    arena_rewind(&pros_arena, mark);
                     return cluster_index;
                 }
             }
         }
     }
     
-    free(fat_buffer);
+    arena_rewind(&pros_arena, mark);
     return 0;
 }
 
@@ -55,14 +82,15 @@ int pros_update_fat(uint32_t cluster, uint32_t value) {
     
     uint32_t fat_sector = boot_sector.fat_start + (cluster * sizeof(uint32_t)) / PROS_SECTOR_SIZE;
     uint32_t fat_offset = (cluster * sizeof(uint32_t)) % PROS_SECTOR_SIZE;
-    uint32_t *fat_buffer = malloc(PROS_SECTOR_SIZE);
+    arena_mark_t mark = arena_mark(&pros_arena);
+    uint32_t *fat_buffer = arena_alloc(&pros_arena, PROS_SECTOR_SIZE);
     
     if (!fat_buffer) {
         return -1;
     }
     
     if (ata_read_sectors(current_device, fat_sector, 1, fat_buffer) != 0) {
-        free(fat_buffer);
+        arena_rewind(&pros_arena, mark);
         return -1;
     }
     
@@ -74,7 +102,7 @@ int pros_update_fat(uint32_t cluster, uint32_t value) {
         result = ata_write_sectors(current_device, fat_sector + boot_sector.fat_size_sectors, 1, fat_buffer);
     }
     
-    free(fat_buffer);
+    arena_rewind(&pros_arena, mark);
     return result;
 }
 
@@ -85,19 +113,20 @@ int pros_read_fat(uint32_t cluster, uint32_t *value) {
     
     uint32_t fat_sector = boot_sector.fat_start + (cluster * sizeof(uint32_t)) / PROS_SECTOR_SIZE;
     uint32_t fat_offset = (cluster * sizeof(uint32_t)) % PROS_SECTOR_SIZE;
-    uint32_t *fat_buffer = malloc(PROS_SECTOR_SIZE);
+    arena_mark_t mark = arena_mark(&pros_arena);
+    uint32_t *fat_buffer = arena_alloc(&pros_arena, PROS_SECTOR_SIZE);
     
     if (!fat_buffer) {
         return -1;
     }
     
     if (ata_read_sectors(current_device, fat_sector, 1, fat_buffer) != 0) {
-        free(fat_buffer);
+        arena_rewind(&pros_arena, mark);
         return -1;
     }
     
     *value = *((uint32_t*)((uint8_t*)fat_buffer + fat_offset));
-    free(fat_buffer);
+    arena_rewind(&pros_arena, mark);
     return 0;
 }
 
@@ -187,7 +216,8 @@ int pros_find_file(const char *name, pros_dir_entry_t *entry) {
     }
     
     uint32_t cluster = boot_sector.root_dir_cluster;
-    uint8_t *sector_buffer = malloc(PROS_SECTOR_SIZE);
+    arena_mark_t mark = arena_mark(&pros_arena);
+    uint8_t *sector_buffer = arena_alloc(&pros_arena, PROS_SECTOR_SIZE);
     
     if (!sector_buffer) {
         return -1;
@@ -202,7 +232,7 @@ int pros_find_file(const char *name, pros_dir_entry_t *entry) {
         for (uint32_t i = 0; i < boot_sector.sectors_per_cluster; i++) {
             if (ata_read_sectors(current_device, lba + i, 1, sector_buffer) != 0) {
                 printf("Failed to read sector %u\n", lba + i);
-                free(sector_buffer);
+                arena_rewind(&pros_arena, mark);
                 return -1;
             }
             
@@ -211,7 +241,7 @@ int pros_find_file(const char *name, pros_dir_entry_t *entry) {
             for (uint32_t j = 0; j < PROS_SECTOR_SIZE / sizeof(pros_dir_entry_t); j++) {
                 if (dir_entry[j].name[0] == PROS_DIR_ENTRY_EMPTY) {
                     printf("End of directory reached\n");
-                    free(sector_buffer);
+                    arena_rewind(&pros_arena, mark);
                     return -1;
                 }
                 
@@ -222,7 +252,7 @@ int pros_find_file(const char *name, pros_dir_entry_t *entry) {
                 if (strcmp(dir_entry[j].name, name) == 0) {
                     *entry = dir_entry[j];
                     printf("File found: %s, cluster: %u\n", name, dir_entry[j].start_cluster);
-                    free(sector_buffer);
+                    arena_rewind(&pros_arena, mark);
                     return 0;
                 }
             }
@@ -231,7 +261,7 @@ int pros_find_file(const char *name, pros_dir_entry_t *entry) {
         uint32_t next_cluster;
         if (pros_read_fat(cluster, &next_cluster) != 0) {
             printf("Failed to read FAT for cluster %u\n", cluster);
-            free(sector_buffer);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
         
@@ -239,7 +269,7 @@ int pros_find_file(const char *name, pros_dir_entry_t *entry) {
         
         if (next_cluster >= 0xFFFFFF8 || next_cluster == PROS_FAT_ENTRY_FREE) {
             printf("End of cluster chain reached\n");
-            free(sector_buffer);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
         
@@ -247,13 +277,14 @@ int pros_find_file(const char *name, pros_dir_entry_t *entry) {
     }
     
     printf("Cluster chain invalid\n");
-    free(sector_buffer);
+    arena_rewind(&pros_arena, mark);
     return -1;
 }
 
 int pros_find_free_dir_entry(uint32_t *cluster_idx, uint32_t *entry_idx) {
     uint32_t cluster = boot_sector.root_dir_cluster;
-    uint8_t *sector_buffer = malloc(PROS_SECTOR_SIZE);
+    arena_mark_t mark = arena_mark(&pros_arena);
+    uint8_t *sector_buffer = arena_alloc(&pros_arena, PROS_SECTOR_SIZE);
     
     if (!sector_buffer) {
         return -1;
@@ -266,7 +297,7 @@ int pros_find_free_dir_entry(uint32_t *cluster_idx, uint32_t *entry_idx) {
         
         for (uint32_t i = 0; i < boot_sector.sectors_per_cluster; i++) {
             if (ata_read_sectors(current_device, lba + i, 1, sector_buffer) != 0) {
-                free(sector_buffer);
+                arena_rewind(&pros_arena, mark);
                 return -1;
             }
             
@@ -277,7 +308,7 @@ int pros_find_free_dir_entry(uint32_t *cluster_idx, uint32_t *entry_idx) {
                     dir_entry[j].name[0] == PROS_DIR_ENTRY_DELETED) {
                     *cluster_idx = cluster;
                     *entry_idx = j + i * entries_per_sector;
-                    free(sector_buffer);
+                    arena_rewind(&pros_arena, mark);
                     return 0;
                 }
             }
@@ -285,43 +316,44 @@ int pros_find_free_dir_entry(uint32_t *cluster_idx, uint32_t *entry_idx) {
         
         uint32_t next_cluster;
         if (pros_read_fat(cluster, &next_cluster) != 0) {
-            free(sector_buffer);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
         
         if (next_cluster >= 0xFFFFFF8) {
             uint32_t new_cluster = pros_find_free_cluster();
             if (new_cluster == 0) {
-                free(sector_buffer);
+                arena_rewind(&pros_arena, mark);
                 return -1;
             }
             
             if (pros_update_fat(cluster, new_cluster) != 0 ||
                 pros_update_fat(new_cluster, PROS_FAT_ENTRY_EOF) != 0) {
-                free(sector_buffer);
+                arena_rewind(&pros_arena, mark);
                 return -1;
             }
             
             uint32_t new_lba = pros_cluster_to_lba(new_cluster);
-            uint8_t *zero_buffer = calloc(1, PROS_SECTOR_SIZE);
+            arena_mark_t zero_mark = arena_mark(&pros_arena);
+            uint8_t *zero_buffer = arena_alloc(&pros_arena, PROS_SECTOR_SIZE);
             if (!zero_buffer) {
-                free(sector_buffer);
+                arena_rewind(&pros_arena, mark);
                 return -1;
             }
+            memset(zero_buffer, 0, PROS_SECTOR_SIZE);
             
             for (uint32_t k = 0; k < boot_sector.sectors_per_cluster; k++) {
                 if (ata_write_sectors(current_device, new_lba + k, 1, zero_buffer) != 0) {
-                    free(sector_buffer);
-                    free(zero_buffer);
+                    arena_rewind(&pros_arena, mark);
                     return -1;
                 }
             }
             
-            free(zero_buffer);
+            arena_rewind(&pros_arena, zero_mark);
             
             *cluster_idx = new_cluster;
             *entry_idx = 0;
-            free(sector_buffer);
+            arena_rewind(&pros_arena, mark);
             return 0;
         }
         
@@ -329,7 +361,7 @@ int pros_find_free_dir_entry(uint32_t *cluster_idx, uint32_t *entry_idx) {
         
     } while (cluster < 0xFFFFFF8);
     
-    free(sector_buffer);
+    arena_rewind(&pros_arena, mark);
     return -1;
 }
 
@@ -339,7 +371,8 @@ int pros_update_dir_entry(const char *name, const pros_dir_entry_t *entry) {
     }
     
     uint32_t cluster = boot_sector.root_dir_cluster;
-    uint8_t *sector_buffer = malloc(PROS_SECTOR_SIZE);
+    arena_mark_t mark = arena_mark(&pros_arena);
+    uint8_t *sector_buffer = arena_alloc(&pros_arena, PROS_SECTOR_SIZE);
     
     if (!sector_buffer) {
         return -1;
@@ -350,7 +383,7 @@ int pros_update_dir_entry(const char *name, const pros_dir_entry_t *entry) {
         
         for (uint32_t i = 0; i < boot_sector.sectors_per_cluster; i++) {
             if (ata_read_sectors(current_device, lba + i, 1, sector_buffer) != 0) {
-                free(sector_buffer);
+                arena_rewind(&pros_arena, mark);
                 return -1;
             }
             
@@ -359,7 +392,7 @@ int pros_update_dir_entry(const char *name, const pros_dir_entry_t *entry) {
             
             for (uint32_t j = 0; j < PROS_SECTOR_SIZE / sizeof(pros_dir_entry_t); j++) {
                 if (dir_entry[j].name[0] == PROS_DIR_ENTRY_EMPTY) {
-                    free(sector_buffer);
+                    arena_rewind(&pros_arena, mark);
                     return -1;
                 }
                 
@@ -373,14 +406,14 @@ int pros_update_dir_entry(const char *name, const pros_dir_entry_t *entry) {
             
             if (updated) {
                 int result = ata_write_sectors(current_device, lba + i, 1, sector_buffer);
-                free(sector_buffer);
+                arena_rewind(&pros_arena, mark);
                 return result;
             }
         }
         
         uint32_t next_cluster;
         if (pros_read_fat(cluster, &next_cluster) != 0) {
-            free(sector_buffer);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
         
@@ -391,10 +424,195 @@ int pros_update_dir_entry(const char *name, const pros_dir_entry_t *entry) {
         cluster = next_cluster;
     } while (1);
     
-    free(sector_buffer);
+    arena_rewind(&pros_arena, mark);
     return -1;
 }
 
+// Цепочка кластеров читается один раз на файл, а не на каждую страницу
+static int pros_mapping_chain(pros_mapping_t *m) {
+    if (m->chain) {
+        return 0;
+    }
+    
+    uint32_t cluster_size = PROS_SECTOR_SIZE * boot_sector.sectors_per_cluster;
+    uint32_t clusters = (m->size + cluster_size - 1) / cluster_size;
+    uint32_t *chain = kmalloc_tag(MAX(clusters, 1) * sizeof(uint32_t), MM_TAG_PROS);
+    
+    if (!chain) {
+        return -1;
+    }
+    
+    int count = pros_get_cluster_chain(m->start_cluster, chain, clusters);
+    if (count < 0) {
+        kfree(chain);
+        return -1;
+    }
+    
+    m->chain = chain;
+    m->nr_clusters = count;
+    return 0;
+}
+
+// Секторы страницы, лежащие внутри файла, идут одной командой в пределах кластера
+static int pros_page_io(pros_mapping_t *m, unsigned long index, void *page, bool write) {
+    if (pros_mapping_chain(m) != 0) {
+        return -1;
+    }
+    
+    uint32_t spc = boot_sector.sectors_per_cluster;
+    uint64_t sector = (uint64_t)index * PROS_PAGE_SECTORS;
+    uint64_t end = MIN(sector + PROS_PAGE_SECTORS, (m->size + PROS_SECTOR_SIZE - 1) / PROS_SECTOR_SIZE);
+    uint8_t *buffer = page;
+    
+    while (sector < end) {
+        uint32_t cluster_idx = sector / spc;
+        if (cluster_idx >= m->nr_clusters) {
+            return -1;
+        }
+        
+        uint32_t in_cluster = sector % spc;
+        uint32_t count = MIN(spc - in_cluster, end - sector);
+        uint32_t lba = pros_cluster_to_lba(m->chain[cluster_idx]) + in_cluster;
+        int ret = write ? ata_write_sectors(current_device, lba, count, buffer)
+                        : ata_read_sectors(current_device, lba, count, buffer);
+        if (ret != 0) {
+            return -1;
+        }
+        
+        buffer += count * PROS_SECTOR_SIZE;
+        sector += count;
+    }
+    
+    return 0;
+}
+
+static int pros_readpage(address_space_t *mapping, unsigned long index, void *page) {
+    // Хвост за концом файла читается нулями
+    memset(page, 0, PAGE_SIZE);
+    return pros_page_io((pros_mapping_t *)mapping->host, index, page, false);
+}
+
+static int pros_writepage(address_space_t *mapping, unsigned long index, const void *page) {
+    pros_mapping_t *m = (pros_mapping_t *)mapping->host;
+    if (m->dead) {
+        return 0;
+    }
+    return pros_page_io(m, index, (void *)page, true);
+}
+
+static const address_space_ops_t pros_aops = {
+    .readpage = pros_readpage,
+    .writepage = pros_writepage,
+};
+
+// Точка фиксации: операция дописана целиком. В write-back кэш записи
+// диска сбрасывается здесь, а не после каждого сектора
+static int pros_commit(int result) {
+    if (current_device && !current_device->write_through && ata_flush(current_device) != 0) {
+        return -1;
+    }
+    return result;
+}
+
+static void pros_mapping_release(pros_mapping_t *m) {
+    if (!m->dead) {
+        pros_commit(pagecache_writeback(&m->mapping));
+    }
+    pagecache_invalidate(&m->mapping);
+    kfree(m->chain);
+    memset(m, 0, sizeof(pros_mapping_t));
+}
+
+static pros_mapping_t *pros_find_mapping(uint32_t start_cluster) {
+    for (int i = 0; i < PROS_MAX_MAPPINGS; i++) {
+        pros_mapping_t *m = &pros_mappings[i];
+        if (m->mapping.ops && !m->dead && m->start_cluster == start_cluster) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+// При нехватке слотов вытесняется файл, который сейчас никто не отображает
+static pros_mapping_t *pros_get_mapping(const pros_dir_entry_t *entry) {
+    pros_mapping_t *m = pros_find_mapping(entry->start_cluster);
+    if (m) {
+        return m;
+    }
+    
+    pros_mapping_t *victim = NULL;
+    for (int i = 0; i < PROS_MAX_MAPPINGS; i++) {
+        if (!pros_mappings[i].mapping.ops) {
+            m = &pros_mappings[i];
+            break;
+        }
+        if (!victim && pros_mappings[i].users == 0) {
+            victim = &pros_mappings[i];
+        }
+    }
+    
+    if (!m) {
+        if (!victim) {
+            return NULL;
+        }
+        pros_mapping_release(victim);
+        m = victim;
+    }
+    
+    m->mapping.ops = &pros_aops;
+    m->mapping.host = m;
+    m->start_cluster = entry->start_cluster;
+    m->size = entry->file_size;
+    return m;
+}
+
+// pros_write_file пишет мимо кэша, поэтому закэшированные страницы обновляются здесь
+static void pros_cache_write(uint32_t start_cluster, const void *data, size_t size, 
+                             uint32_t offset, uint64_t file_size) {
+    pros_mapping_t *m = pros_find_mapping(start_cluster);
+    if (!m) {
+        return;
+    }
+    
+    if (file_size > m->size) {
+        m->size = file_size;
+        kfree(m->chain);
+        m->chain = NULL;
+    }
+    
+    size_t done = 0;
+    while (done < size) {
+        uint64_t pos = (uint64_t)offset + done;
+        size_t chunk = MIN(size - done, PAGE_SIZE - (pos & (PAGE_SIZE - 1)));
+        uint8_t *page = pagecache_lookup(&m->mapping, pos >> PAGE_SHIFT);
+        
+        if (page) {
+            memcpy(page + (pos & (PAGE_SIZE - 1)), (const uint8_t *)data + done, chunk);
+        }
+        done += chunk;
+    }
+}
+
+// Удаление или обрезка: уже отображённые страницы остаются у пользователей,
+// но на диск больше не попадают
+static void pros_cache_drop(uint32_t start_cluster, bool writeback) {
+    pros_mapping_t *m = pros_find_mapping(start_cluster);
+    if (!m) {
+        return;
+    }
+    
+    if (writeback) {
+        pros_commit(pagecache_writeback(&m->mapping));
+    }
+    
+    m->dead = true;
+    if (m->users == 0) {
+        pros_mapping_release(m);
+    } else {
+        pagecache_invalidate(&m->mapping);
+    }
+}
+
 int pros_format(ata_device_t *dev) {
     if (!dev || !dev->exists) {
         printf("Invalid device for formatting\n");
@@ -453,7 +671,9 @@ int pros_format(ata_device_t *dev) {
         return -1;
     }
 
-    uint32_t *fat_buffer = (uint32_t*)malloc(PROS_SECTOR_SIZE);
+    arena_mark_t mark = arena_mark(&pros_arena);
+
+    uint32_t *fat_buffer = arena_alloc(&pros_arena, PROS_SECTOR_SIZE);
     if (!fat_buffer) {
         printf("Failed to allocate memory for FAT\n");
         return -1;
@@ -468,29 +688,32 @@ int pros_format(ata_device_t *dev) {
         
         if (ata_write_sectors(dev, bs.fat_start + i * fat_size_sectors, 1, fat_buffer) != 0) {
             printf("Failed to write FAT\n");
-            free(fat_buffer);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
     }
 
-    free(fat_buffer);
+    arena_rewind(&pros_arena, mark);
 
-    uint8_t *zero_buffer = (uint8_t*)calloc(1, PROS_SECTOR_SIZE);
+    arena_mark_t zero_mark = arena_mark(&pros_arena);
+    uint8_t *zero_buffer = arena_alloc(&pros_arena, PROS_SECTOR_SIZE);
     if (!zero_buffer) {
         printf("Failed to allocate memory for zero buffer\n");
         return -1;
     }
 
+    memset(zero_buffer, 0, PROS_SECTOR_SIZE);
+
     uint32_t root_dir_lba = pros_cluster_to_lba(bs.root_dir_cluster);
     for (uint32_t i = 0; i < sectors_per_cluster; i++) {
         if (ata_write_sectors(dev, root_dir_lba + i, 1, zero_buffer) != 0) {
             printf("Failed to clear root directory\n");
-            free(zero_buffer);
+            arena_rewind(&pros_arena, zero_mark);
             return -1;
         }
     }
 
-    free(zero_buffer);
+    arena_rewind(&pros_arena, zero_mark);
 
     memcpy(&boot_sector, &bs, sizeof(pros_boot_sector_t));
 
@@ -498,17 +721,26 @@ int pros_format(ata_device_t *dev) {
         memset(&open_files[i], 0, sizeof(pros_file_t));
     }
 
+    if (ata_flush(dev) != 0) {
+        return -1;
+    }
+
     printf("Formatted successfully: %llu sectors, %u clusters, FAT size: %u sectors\n",
            total_sectors, cluster_count, fat_size_sectors);
     return 0;
 }
 
 int pros_init(ata_device_t *dev) {
+    return pros_mount(dev, 0);
+}
+
+int pros_mount(ata_device_t *dev, uint32_t flags) {
     if (!dev || !dev->exists) {
         return -1;
     }
     
     current_device = dev;
+    dev->write_through = (flags & PROS_MOUNT_WRITE_THROUGH) != 0;
     
     if (ata_read_sectors(dev, PROS_BOOT_SECTOR, 1, &boot_sector) != 0) {
         return -1;
@@ -550,7 +782,9 @@ int pros_create_file(const char *name, uint8_t attributes) {
     
     uint32_t lba = pros_cluster_to_lba(free_cluster_idx) + sector_index;
     
-    uint8_t *sector_buffer = malloc(PROS_SECTOR_SIZE);
+    arena_mark_t mark = arena_mark(&pros_arena);
+    
+    uint8_t *sector_buffer = arena_alloc(&pros_arena, PROS_SECTOR_SIZE);
     if (!sector_buffer) {
         printf("Failed to allocate sector buffer\n");
         return -1;
@@ -558,7 +792,7 @@ int pros_create_file(const char *name, uint8_t attributes) {
     
     if (ata_read_sectors(current_device, lba, 1, sector_buffer) != 0) {
         printf("Failed to read directory sector\n");
-        free(sector_buffer);
+        arena_rewind(&pros_arena, mark);
         return -1;
     }
     
@@ -567,7 +801,7 @@ int pros_create_file(const char *name, uint8_t attributes) {
     uint32_t file_cluster = pros_find_free_cluster();
     if (file_cluster == 0) {
         printf("No free clusters available\n");
-        free(sector_buffer);
+        arena_rewind(&pros_arena, mark);
         return -1;
     }
     
@@ -575,7 +809,7 @@ int pros_create_file(const char *name, uint8_t attributes) {
     
     if (pros_update_fat(file_cluster, PROS_FAT_ENTRY_EOF) != 0) {
         printf("Failed to update FAT for cluster %u\n", file_cluster);
-        free(sector_buffer);
+        arena_rewind(&pros_arena, mark);
         return -1;
     }
     
@@ -594,13 +828,13 @@ int pros_create_file(const char *name, uint8_t attributes) {
     
     if (ata_write_sectors(current_device, lba, 1, sector_buffer) != 0) {
         printf("Failed to write directory sector\n");
-        free(sector_buffer);
+        arena_rewind(&pros_arena, mark);
         return -1;
     }
     
-    free(sector_buffer);
+    arena_rewind(&pros_arena, mark);
     printf("File created successfully: %s\n", name);
-    return 0;
+    return pros_commit(0);
 }
 
 int pros_rename_file(const char *old_name, const char *new_name) {
@@ -635,7 +869,7 @@ int pros_rename_file(const char *old_name, const char *new_name) {
         }
     }
     
-    return 0;
+    return pros_commit(0);
 }
 
 int pros_write_file(const char *name, const void *data, size_t size, uint32_t offset) {
@@ -653,7 +887,8 @@ int pros_write_file(const char *name, const void *data, size_t size, uint32_t of
     uint32_t clusters_needed = (sectors_needed + boot_sector.sectors_per_cluster - 1) / boot_sector.sectors_per_cluster;
     
     uint32_t current_clusters = 0;
-    uint32_t *cluster_chain = malloc(clusters_needed * sizeof(uint32_t));
+    arena_mark_t mark = arena_mark(&pros_arena);
+    uint32_t *cluster_chain = arena_alloc(&pros_arena, clusters_needed * sizeof(uint32_t));
     
     if (!cluster_chain) {
         return -1;
@@ -663,7 +898,7 @@ int pros_write_file(const char *name, const void *data, size_t size, uint32_t of
         current_clusters = pros_get_cluster_chain(entry.start_cluster, cluster_chain, clusters_needed);
         
         if (current_clusters == (uint32_t)-1) {
-            free(cluster_chain);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
     }
@@ -673,7 +908,7 @@ int pros_write_file(const char *name, const void *data, size_t size, uint32_t of
             entry.start_cluster = pros_find_free_cluster();
             
             if (entry.start_cluster == 0) {
-                free(cluster_chain);
+                arena_rewind(&pros_arena, mark);
                 return -1;
             }
             
@@ -682,7 +917,7 @@ int pros_write_file(const char *name, const void *data, size_t size, uint32_t of
         }
         
         if (pros_allocate_cluster_chain(cluster_chain[current_clusters - 1], clusters_needed - current_clusters + 1) != 0) {
-            free(cluster_chain);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
         
@@ -700,7 +935,7 @@ int pros_write_file(const char *name, const void *data, size_t size, uint32_t of
         uint8_t sector_buffer[PROS_SECTOR_SIZE];
         
         if (ata_read_sectors(current_device, lba, 1, sector_buffer) != 0) {
-            free(cluster_chain);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
         
@@ -708,7 +943,7 @@ int pros_write_file(const char *name, const void *data, size_t size, uint32_t of
         memcpy(sector_buffer + byte_offset, (uint8_t*)data + bytes_written, bytes_to_write);
         
         if (ata_write_sectors(current_device, lba, 1, sector_buffer) != 0) {
-            free(cluster_chain);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
         
@@ -729,12 +964,14 @@ int pros_write_file(const char *name, const void *data, size_t size, uint32_t of
     entry.modify_time = time(NULL);
     
     if (pros_update_dir_entry(name, &entry) != 0) {
-        free(cluster_chain);
+        arena_rewind(&pros_arena, mark);
         return -1;
     }
     
-    free(cluster_chain);
-    return bytes_written;
+    pros_cache_write(entry.start_cluster, data, bytes_written, offset, entry.file_size);
+    
+    arena_rewind(&pros_arena, mark);
+    return pros_commit(bytes_written);
 }
 
 int pros_read_file(const char *name, void *buffer, size_t size, uint32_t offset) {
@@ -756,7 +993,9 @@ int pros_read_file(const char *name, void *buffer, size_t size, uint32_t offset)
     uint32_t sectors_needed = (size + offset + PROS_SECTOR_SIZE - 1) / PROS_SECTOR_SIZE;
     uint32_t clusters_needed = (sectors_needed + boot_sector.sectors_per_cluster - 1) / boot_sector.sectors_per_cluster;
     
-    uint32_t *cluster_chain = malloc(clusters_needed * sizeof(uint32_t));
+    arena_mark_t mark = arena_mark(&pros_arena);
+    
+    uint32_t *cluster_chain = arena_alloc(&pros_arena, clusters_needed * sizeof(uint32_t));
     
     if (!cluster_chain) {
         return -1;
@@ -765,7 +1004,7 @@ int pros_read_file(const char *name, void *buffer, size_t size, uint32_t offset)
     uint32_t chain_length = pros_get_cluster_chain(entry.start_cluster, cluster_chain, clusters_needed);
     
     if (chain_length == (uint32_t)-1) {
-        free(cluster_chain);
+        arena_rewind(&pros_arena, mark);
         return -1;
     }
     
@@ -780,7 +1019,7 @@ int pros_read_file(const char *name, void *buffer, size_t size, uint32_t offset)
         uint8_t sector_buffer[PROS_SECTOR_SIZE];
         
         if (ata_read_sectors(current_device, lba, 1, sector_buffer) != 0) {
-            free(cluster_chain);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
         
@@ -797,7 +1036,7 @@ int pros_read_file(const char *name, void *buffer, size_t size, uint32_t offset)
         }
     }
     
-    free(cluster_chain);
+    arena_rewind(&pros_arena, mark);
     return bytes_read;
 }
 
@@ -811,6 +1050,8 @@ int pros_delete_file(const char *name) {
         return -1;
     }
     
+    pros_cache_drop(entry.start_cluster, false);
+    
     if (pros_free_cluster_chain(entry.start_cluster) != 0) {
         return -1;
     }
@@ -825,12 +1066,13 @@ int pros_delete_file(const char *name) {
     memset(&empty_entry, 0, sizeof(pros_dir_entry_t));
     empty_entry.name[0] = PROS_DIR_ENTRY_DELETED;
     
-    return pros_update_dir_entry(name, &empty_entry);
+    return pros_commit(pros_update_dir_entry(name, &empty_entry));
 }
 
 int pros_list_files(void) {
     uint32_t cluster = boot_sector.root_dir_cluster;
-    uint8_t *sector_buffer = malloc(PROS_SECTOR_SIZE);
+    arena_mark_t mark = arena_mark(&pros_arena);
+    uint8_t *sector_buffer = arena_alloc(&pros_arena, PROS_SECTOR_SIZE);
     int file_count = 0;
     
     if (!sector_buffer) {
@@ -846,7 +1088,7 @@ int pros_list_files(void) {
         
         for (uint32_t i = 0; i < boot_sector.sectors_per_cluster; i++) {
             if (ata_read_sectors(current_device, lba + i, 1, sector_buffer) != 0) {
-                free(sector_buffer);
+                arena_rewind(&pros_arena, mark);
                 return -1;
             }
             
@@ -854,7 +1096,7 @@ int pros_list_files(void) {
             
             for (uint32_t j = 0; j < PROS_SECTOR_SIZE / sizeof(pros_dir_entry_t); j++) {
                 if (dir_entry[j].name[0] == PROS_DIR_ENTRY_EMPTY) {
-                    free(sector_buffer);
+                    arena_rewind(&pros_arena, mark);
                     printf("Total files: %d\n", file_count);
                     return file_count;
                 }
@@ -876,7 +1118,7 @@ int pros_list_files(void) {
         
         uint32_t next_cluster;
         if (pros_read_fat(cluster, &next_cluster) != 0) {
-            free(sector_buffer);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
         
@@ -887,7 +1129,7 @@ int pros_list_files(void) {
         cluster = next_cluster;
     } while (1);
     
-    free(sector_buffer);
+    arena_rewind(&pros_arena, mark);
     printf("Total files: %d\n", file_count);
     return file_count;
 }
@@ -1031,11 +1273,15 @@ int pros_truncate_file(const char *name, uint64_t new_size) {
         return 0;
     }
     
+    pros_cache_drop(entry.start_cluster, true);
+    
     if (new_size < entry.file_size) {
         uint32_t sectors_needed = (new_size + PROS_SECTOR_SIZE - 1) / PROS_SECTOR_SIZE;
         uint32_t clusters_needed = (sectors_needed + boot_sector.sectors_per_cluster - 1) / boot_sector.sectors_per_cluster;
         
-        uint32_t *cluster_chain = malloc((clusters_needed + 1) * sizeof(uint32_t));
+        arena_mark_t mark = arena_mark(&pros_arena);
+        
+        uint32_t *cluster_chain = arena_alloc(&pros_arena, (clusters_needed + 1) * sizeof(uint32_t));
         
         if (!cluster_chain) {
             return -1;
@@ -1044,29 +1290,30 @@ int pros_truncate_file(const char *name, uint64_t new_size) {
         uint32_t chain_length = pros_get_cluster_chain(entry.start_cluster, cluster_chain, clusters_needed + 1);
         
         if (chain_length == (uint32_t)-1) {
-            free(cluster_chain);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
         
         if (chain_length > clusters_needed) {
             if (pros_free_cluster_chain(cluster_chain[clusters_needed]) != 0) {
-                free(cluster_chain);
+                arena_rewind(&pros_arena, mark);
                 return -1;
             }
             
             if (pros_update_fat(cluster_chain[clusters_needed - 1], PROS_FAT_ENTRY_EOF) != 0) {
-                free(cluster_chain);
+                arena_rewind(&pros_arena, mark);
                 return -1;
             }
         }
         
-        free(cluster_chain);
+        arena_rewind(&pros_arena, mark);
     } else {
         uint32_t sectors_needed = (new_size + PROS_SECTOR_SIZE - 1) / PROS_SECTOR_SIZE;
         uint32_t clusters_needed = (sectors_needed + boot_sector.sectors_per_cluster - 1) / boot_sector.sectors_per_cluster;
         
         uint32_t current_clusters = 0;
-        uint32_t *cluster_chain = malloc(clusters_needed * sizeof(uint32_t));
+        arena_mark_t mark = arena_mark(&pros_arena);
+        uint32_t *cluster_chain = arena_alloc(&pros_arena, clusters_needed * sizeof(uint32_t));
         
         if (!cluster_chain) {
             return -1;
@@ -1076,7 +1323,7 @@ int pros_truncate_file(const char *name, uint64_t new_size) {
             current_clusters = pros_get_cluster_chain(entry.start_cluster, cluster_chain, clusters_needed);
             
             if (current_clusters == (uint32_t)-1) {
-                free(cluster_chain);
+                arena_rewind(&pros_arena, mark);
                 return -1;
             }
         }
@@ -1086,7 +1333,7 @@ int pros_truncate_file(const char *name, uint64_t new_size) {
                 entry.start_cluster = pros_find_free_cluster();
                 
                 if (entry.start_cluster == 0) {
-                    free(cluster_chain);
+                    arena_rewind(&pros_arena, mark);
                     return -1;
                 }
                 
@@ -1095,12 +1342,12 @@ int pros_truncate_file(const char *name, uint64_t new_size) {
             }
             
             if (pros_allocate_cluster_chain(cluster_chain[current_clusters - 1], clusters_needed - current_clusters + 1) != 0) {
-                free(cluster_chain);
+                arena_rewind(&pros_arena, mark);
                 return -1;
             }
         }
         
-        free(cluster_chain);
+        arena_rewind(&pros_arena, mark);
     }
     
     entry.file_size = new_size;
@@ -1119,7 +1366,7 @@ int pros_truncate_file(const char *name, uint64_t new_size) {
         }
     }
     
-    return 0;
+    return pros_commit(0);
 }
 
 int pros_create_directory(const char *name) {
@@ -1151,7 +1398,8 @@ int pros_get_free_space(uint64_t *free_bytes) {
     uint32_t free_clusters = 0;
     uint32_t fat_sector = boot_sector.fat_start;
     uint32_t fat_entries_per_sector = PROS_SECTOR_SIZE / sizeof(uint32_t);
-    uint32_t *fat_buffer = malloc(PROS_SECTOR_SIZE);
+    arena_mark_t mark = arena_mark(&pros_arena);
+    uint32_t *fat_buffer = arena_alloc(&pros_arena, PROS_SECTOR_SIZE);
     
     if (!fat_buffer) {
         return -1;
@@ -1159,7 +1407,7 @@ int pros_get_free_space(uint64_t *free_bytes) {
     
     for (uint32_t i = 0; i < boot_sector.fat_size_sectors; i++) {
         if (ata_read_sectors(current_device, fat_sector + i, 1, fat_buffer) != 0) {
-            free(fat_buffer);
+            arena_rewind(&pros_arena, mark);
             return -1;
         }
         
@@ -1173,7 +1421,7 @@ int pros_get_free_space(uint64_t *free_bytes) {
         }
     }
     
-    free(fat_buffer);
+    arena_rewind(&pros_arena, mark);
     *free_bytes = free_clusters * boot_sector.sectors_per_cluster * PROS_SECTOR_SIZE;
     return 0;
 }
@@ -1189,4 +1437,97 @@ int pros_get_total_space(uint64_t *total_bytes) {
 
 int pros_defragment(void) {
     return 0;
+}
+
+static void *pros_vm_fault(vm_struct_t *area, unsigned long index) {
+    pros_vma_t *vma = (pros_vma_t *)area->private;
+    return pagecache_get(&vma->file->mapping, vma->pgoff + index);
+}
+
+static void pros_vm_release(vm_struct_t *area, unsigned long index, void *page) {
+    (void)area;
+    (void)index;
+    put_page(page);
+}
+
+static const vm_ops_t pros_vm_ops = {
+    .fault = pros_vm_fault,
+    .release = pros_vm_release,
+};
+
+// Страницы файла подтягиваются в кэш при первом обращении к отображению.
+// Запись за концом файла в него не попадает
+void *pros_mmap(const char *name, uint32_t offset, size_t len) {
+    if (!name || len == 0 || (offset & (PAGE_SIZE - 1))) {
+        return NULL;
+    }
+    
+    pros_dir_entry_t entry;
+    if (pros_find_file(name, &entry) != 0 || entry.start_cluster == 0 || offset >= entry.file_size) {
+        return NULL;
+    }
+    
+    pros_mapping_t *m = pros_get_mapping(&entry);
+    if (!m) {
+        return NULL;
+    }
+    
+    pros_vma_t *vma = kmalloc_tag(sizeof(pros_vma_t), MM_TAG_PROS);
+    if (!vma) {
+        return NULL;
+    }
+    
+    vma->file = m;
+    vma->pgoff = offset >> PAGE_SHIFT;
+    
+    uint64_t prot = (entry.attributes & PROS_ATTR_READ_ONLY) ? 0 : PAGE_WRITABLE;
+    void *addr = vm_reserve(len, prot, &pros_vm_ops, vma);
+    if (!addr) {
+        kfree(vma);
+        return NULL;
+    }
+    
+    m->users++;
+    return addr;
+}
+
+// Грязные страницы находятся по биту Dirty в PTE отображения
+int pros_msync(void *addr, size_t len) {
+    vm_struct_t *area = find_vm_area(addr);
+    if (!area || area->ops != &pros_vm_ops) {
+        return -1;
+    }
+    
+    pros_vma_t *vma = (pros_vma_t *)area->private;
+    uintptr_t start = (uintptr_t)addr - area->addr;
+    size_t first = start >> PAGE_SHIFT;
+    size_t last = MIN(area->nr_pages, (start + len + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    
+    for (size_t i = first; i < last; i++) {
+        if (area->pages[i] && pte_test_and_clear_dirty(area->addr + i * PAGE_SIZE)) {
+            pagecache_set_dirty(area->pages[i]);
+        }
+    }
+    
+    return pros_commit(pagecache_writeback(&vma->file->mapping));
+}
+
+int pros_munmap(void *addr) {
+    vm_struct_t *area = find_vm_area(addr);
+    if (!area || area->ops != &pros_vm_ops || area->addr != (uintptr_t)addr) {
+        return -1;
+    }
+    
+    pros_vma_t *vma = (pros_vma_t *)area->private;
+    pros_mapping_t *m = vma->file;
+    int ret = pros_msync(addr, area->nr_pages * PAGE_SIZE);
+    
+    vfree(addr);
+    kfree(vma);
+    
+    if (--m->users == 0 && m->dead) {
+        pros_mapping_release(m);
+    }
+    
+    return ret;
 }
\ No newline at end of file
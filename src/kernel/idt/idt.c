@@ -2,6 +2,7 @@
 #include <asm/io.h>
 #include <stdio.h>
 #include <string.h>
+#include "../mm/mem.h"
 
 #define IDT_ENTRIES 256
 
@@ -78,6 +79,13 @@ void idt_init() {
 }
 
 void exception_handler(struct registers* regs) {
+    uint64_t cr2 = 0;
+    if (regs->int_no == 14) {
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+        if (mm_handle_page_fault(cr2, regs->err_code) == 0)
+            return;
+    }
+    
     printf("\n!!! EXCEPTION !!!\nINT: %d (%s)\nERR: 0x%llX\n",
               regs->int_no, exception_messages[regs->int_no], regs->err_code);
     
@@ -85,6 +93,8 @@ void exception_handler(struct registers* regs) {
               regs->rax, regs->rbx, regs->rcx, regs->rdx);
     printf("RSP: 0x%llX RBP: 0x%llX\nRIP: 0x%llX\n",
               regs->frame.rsp, regs->rbp, regs->frame.rip);
+    if (regs->int_no == 14)
+        printf("CR2: 0x%llX\n", cr2);
     
     if (regs->int_no != 3) asm volatile("cli; hlt");
 }
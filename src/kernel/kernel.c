@@ -24,8 +24,13 @@
 extern void shell();
 extern void _s();
 
+extern uint32_t multiboot_magic;
+extern uint32_t* multiboot_info;
+
 void kmain() {
     idt_init();
+    mm_init(multiboot_magic, multiboot_info);
+    
     init_timer(100);
     init_keyboard();
     pci_init();
@@ -35,11 +40,6 @@ void kmain() {
     ata_init();
     ata_device_t *hdd = get_ata_device(0);
 
-    uintptr_t phys_mem_start = 0x100000;
-    uintptr_t phys_mem_end = 32 * 1024 * 1024;
-    
-    mm_init(phys_mem_start, phys_mem_end); 
-
     mouse_init();
     //shell();
 
@@ -86,6 +86,8 @@ void kmain() {
 
         draw_string(10, 10, fps_text, 0xFFFFFFFF);
         swap_buffers();
+        
+        mm_idle();
     }
 
     for (;;);
@@ -0,0 +1,97 @@
+#include "arena.h"
+
+#define ARENA_HEADER_SIZE   ALIGN_UP(sizeof(arena_chunk_t), ARENA_ALIGN)
+
+static arena_chunk_t *arena_chunk_alloc(arena_t *arena, size_t size) {
+    size_t chunk_size = arena->chunk_size ? arena->chunk_size : ARENA_DEFAULT_SIZE;
+    if (size + ARENA_HEADER_SIZE > chunk_size)
+        chunk_size = size + ARENA_HEADER_SIZE;
+        
+    int order = get_order(chunk_size);
+    arena_chunk_t *chunk = (arena_chunk_t *)page_alloc(order);
+    if (!chunk)
+        return NULL;
+        
+    chunk->prev = arena->current;
+    chunk->size = (PAGE_SIZE << order) - ARENA_HEADER_SIZE;
+    chunk->used = 0;
+    chunk->order = order;
+    return chunk;
+}
+
+static inline void *arena_chunk_data(arena_chunk_t *chunk) {
+    return (uint8_t *)chunk + ARENA_HEADER_SIZE;
+}
+
+void arena_init(arena_t *arena, size_t chunk_size) {
+    arena->current = NULL;
+    arena->chunk_size = chunk_size;
+}
+
+arena_t *arena_create(size_t chunk_size) {
+    arena_t *arena = (arena_t *)kmalloc(sizeof(arena_t));
+    if (arena)
+        arena_init(arena, chunk_size);
+    return arena;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    if (!arena || size == 0)
+        return NULL;
+        
+    size = ALIGN_UP(size, ARENA_ALIGN);
+    arena_chunk_t *chunk = arena->current;
+    
+    if (!chunk || chunk->size - chunk->used < size) {
+        chunk = arena_chunk_alloc(arena, size);
+        if (!chunk)
+            return NULL;
+        arena->current = chunk;
+    }
+    
+    void *ptr = (uint8_t *)arena_chunk_data(chunk) + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+arena_mark_t arena_mark(arena_t *arena) {
+    arena_mark_t mark = { arena->current, arena->current ? arena->current->used : 0 };
+    return mark;
+}
+
+// Освобождает всё, что выделено после mark. Самый первый кусок остаётся за ареной,
+// чтобы следующая операция снова обошлась без buddy
+void arena_rewind(arena_t *arena, arena_mark_t mark) {
+    while (arena->current && arena->current != mark.chunk) {
+        arena_chunk_t *chunk = arena->current;
+        
+        if (!chunk->prev && !mark.chunk) {
+            chunk->used = 0;
+            return;
+        }
+        
+        arena->current = chunk->prev;
+        page_free(chunk, chunk->order);
+    }
+    
+    if (arena->current)
+        arena->current->used = mark.used;
+}
+
+void arena_reset(arena_t *arena) {
+    arena_mark_t empty = { NULL, 0 };
+    arena_rewind(arena, empty);
+}
+
+void arena_destroy(arena_t *arena) {
+    if (!arena)
+        return;
+        
+    while (arena->current) {
+        arena_chunk_t *chunk = arena->current;
+        arena->current = chunk->prev;
+        page_free(chunk, chunk->order);
+    }
+    
+    kfree(arena);
+}
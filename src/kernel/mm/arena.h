@@ -0,0 +1,37 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "mem.h"
+
+#define ARENA_ALIGN         16
+#define ARENA_DEFAULT_SIZE  (PAGE_SIZE << 2)
+
+// Кусок арены - целые страницы из buddy, данные идут сразу за заголовком
+typedef struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size;
+    size_t used;
+    int order;
+} arena_chunk_t;
+
+// Обнулённый arena_t уже готов к работе
+typedef struct arena {
+    arena_chunk_t *current;
+    size_t chunk_size;
+} arena_t;
+
+typedef struct {
+    arena_chunk_t *chunk;
+    size_t used;
+} arena_mark_t;
+
+void arena_init(arena_t *arena, size_t chunk_size);
+arena_t *arena_create(size_t chunk_size);
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_reset(arena_t *arena);
+void arena_destroy(arena_t *arena);
+
+arena_mark_t arena_mark(arena_t *arena);
+void arena_rewind(arena_t *arena, arena_mark_t mark);
+
+#endif
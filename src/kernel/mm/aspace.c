@@ -0,0 +1,208 @@
+#include "aspace.h"
+#include "string.h"
+#include "stdio.h"
+#include <asm/io.h>
+
+#define ASPACE_BENCH_ROUNDS 2000
+#define ASPACE_BENCH_ORDER  6
+
+static struct {
+    aspace_t kernel;
+    aspace_t *current;
+    bool pcid;
+    bool use_pcid;
+    uint16_t next_asid;
+    uint64_t generation;
+    uint64_t rollovers;
+} aspaces;
+
+static bool cpu_has_pcid(void) {
+    uint32_t eax, ebx, ecx, edx;
+    
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    return ecx & (1U << 17);
+}
+
+static inline void write_cr3(uint64_t cr3) {
+    asm volatile("mov %0, %%cr3" : : "r" (cr3) : "memory");
+}
+
+void aspace_init(void) {
+    aspaces.kernel.pml4 = (uint64_t *)phys_to_virt(PML4_BASE);
+    aspaces.kernel.pml4_phys = PML4_BASE;
+    aspaces.kernel.asid = 0;
+    aspaces.kernel.kernel_gen = mm_kernel_pml4_gen();
+    aspaces.current = &aspaces.kernel;
+    aspaces.next_asid = 1;
+    aspaces.generation = 1;
+    
+    // Полный сброс при нехватке PCID делается через CR4.PGE, поэтому без PGE не включаем.
+    // Загрузочный CR3 выровнен, его PCID уже 0
+    if (mm_global_pages() && cpu_has_pcid()) {
+        asm volatile("mov %%cr4, %%rax; or $0x20000, %%rax; mov %%rax, %%cr4" : : : "rax", "memory");
+        aspaces.pcid = true;
+        aspaces.use_pcid = true;
+    }
+    
+    printf("  PCID: %s\n", aspaces.pcid ? "enabled" : "not supported");
+}
+
+// Номер 0 навсегда за ядром; когда номера кончаются, начинается новое поколение
+// и все старые PCID сбрасываются одним махом
+static void aspace_new_asid(aspace_t *as) {
+    if (aspaces.next_asid == ASID_COUNT) {
+        aspaces.generation++;
+        aspaces.rollovers++;
+        aspaces.next_asid = 1;
+        flush_tlb_all();
+    }
+    
+    as->asid = aspaces.next_asid++;
+    as->asid_gen = aspaces.generation;
+}
+
+static void aspace_sync_kernel(aspace_t *as) {
+    uint64_t *kernel = aspaces.kernel.pml4;
+    
+    as->pml4[0] = kernel[0];
+    memcpy(&as->pml4[ASPACE_KERNEL_SLOT], &kernel[ASPACE_KERNEL_SLOT], 
+           (512 - ASPACE_KERNEL_SLOT) * sizeof(uint64_t));
+    as->kernel_gen = mm_kernel_pml4_gen();
+}
+
+aspace_t *aspace_create(void) {
+    aspace_t *as = (aspace_t *)kmalloc(sizeof(aspace_t));
+    if (!as)
+        return NULL;
+        
+    memset(as, 0, sizeof(*as));
+    as->pml4 = (uint64_t *)alloc_pages(GFP_ZERO, 0);
+    if (!as->pml4) {
+        kfree(as);
+        return NULL;
+    }
+    
+    as->pml4_phys = virt_to_phys((uintptr_t)as->pml4);
+    aspace_sync_kernel(as);
+    return as;
+}
+
+void aspace_destroy(aspace_t *as) {
+    if (!as || as == &aspaces.kernel)
+        return;
+        
+    if (aspaces.current == as)
+        aspace_switch(&aspaces.kernel);
+        
+    // Старые записи его PCID уйдут при смене поколения, номер до тех пор не повторится
+    unmap_range_in(as->pml4, ASPACE_USER_START, ASPACE_USER_END - ASPACE_USER_START);
+    page_free(as->pml4, 0);
+    kfree(as);
+}
+
+void aspace_switch(aspace_t *as) {
+    if (as == aspaces.current)
+        return;
+        
+    if (as->kernel_gen != mm_kernel_pml4_gen())
+        aspace_sync_kernel(as);
+        
+    uint64_t cr3 = as->pml4_phys;
+    if (aspaces.use_pcid) {
+        if (as != &aspaces.kernel && as->asid_gen != aspaces.generation)
+            aspace_new_asid(as);
+        cr3 |= as->asid | CR3_NOFLUSH;
+    }
+    
+    write_cr3(cr3);
+    aspaces.current = as;
+}
+
+aspace_t *aspace_current(void) {
+    return aspaces.current;
+}
+
+// Записи неактивного пространства могли остаться в TLB под его PCID,
+// поэтому оно получит новый номер при следующем переключении
+static void aspace_flush(aspace_t *as, uintptr_t virt, size_t size) {
+    if (as == aspaces.current)
+        flush_tlb_range(virt, virt + ALIGN_UP(size, PAGE_SIZE));
+    else
+        as->asid_gen = 0;
+}
+
+int aspace_map(aspace_t *as, uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags) {
+    if (virt < ASPACE_USER_START || virt + size > ASPACE_USER_END || virt + size < virt)
+        return -1;
+        
+    int ret = map_range_in(as->pml4, virt, phys, size, flags & ~PAGE_GLOBAL);
+    aspace_flush(as, virt, size);
+    return ret;
+}
+
+void aspace_unmap(aspace_t *as, uintptr_t virt, size_t size) {
+    if (virt < ASPACE_USER_START || virt + size > ASPACE_USER_END || virt + size < virt)
+        return;
+        
+    unmap_range_in(as->pml4, virt, size);
+    aspace_flush(as, virt, size);
+}
+
+// Среднее на одно переключение, с обходом страниц, отображённых в обоих пространствах
+static uint64_t aspace_bench_run(aspace_t *a, aspace_t *b, size_t touch) {
+    uint64_t start = rdtsc();
+    
+    for (int i = 0; i < ASPACE_BENCH_ROUNDS; i++) {
+        aspace_switch((i & 1) ? b : a);
+        for (size_t p = 0; p < touch; p++) {
+            (void)*(volatile uint8_t *)(ASPACE_USER_START + p * PAGE_SIZE);
+        }
+    }
+    
+    uint64_t cycles = rdtsc() - start;
+    aspace_switch(&aspaces.kernel);
+    return cycles / ASPACE_BENCH_ROUNDS;
+}
+
+void aspace_bench(void) {
+    size_t pages = 1UL << ASPACE_BENCH_ORDER;
+    void *buffer = page_alloc(ASPACE_BENCH_ORDER);
+    aspace_t *a = aspace_create();
+    aspace_t *b = aspace_create();
+    
+    if (!buffer || !a || !b ||
+        aspace_map(a, ASPACE_USER_START, virt_to_phys((uintptr_t)buffer), pages * PAGE_SIZE,
+                   PAGE_PRESENT | PAGE_WRITABLE) != 0 ||
+        aspace_map(b, ASPACE_USER_START, virt_to_phys((uintptr_t)buffer), pages * PAGE_SIZE,
+                   PAGE_PRESENT | PAGE_WRITABLE) != 0) {
+        printf("tlbbench: out of memory\n");
+        aspace_destroy(a);
+        aspace_destroy(b);
+        page_free(buffer, ASPACE_BENCH_ORDER);
+        return;
+    }
+    
+    bool saved = aspaces.use_pcid;
+    printf("Address space switch, cycles per switch (%u rounds):\n", ASPACE_BENCH_ROUNDS);
+    
+    for (int mode = 0; mode < 2; mode++) {
+        if (mode == 1 && !aspaces.pcid)
+            break;
+            
+        // Смена режима оставляет в TLB записи чужих пространств под PCID 0
+        aspaces.use_pcid = mode == 1;
+        flush_tlb_all();
+        
+        uint64_t bare = aspace_bench_run(a, b, 0);
+        uint64_t touched = aspace_bench_run(a, b, pages);
+        printf("  %s: switch %lld, switch + %u page touches %lld\n", 
+               mode ? "PCID" : "no PCID", (long long)bare, (unsigned int)pages, (long long)touched);
+    }
+    
+    aspaces.use_pcid = saved;
+    flush_tlb_all();
+    
+    aspace_destroy(a);
+    aspace_destroy(b);
+    page_free(buffer, ASPACE_BENCH_ORDER);
+}
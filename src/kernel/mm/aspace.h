@@ -0,0 +1,32 @@
+#ifndef ASPACE_H
+#define ASPACE_H
+
+#include "mem.h"
+
+#define ASID_COUNT      4096
+#define CR3_NOFLUSH     (1UL << 63)
+
+// Слоты PML4 1..255 свои у каждого пространства; слот 0 (тождественное
+// отображение ядра) и верхняя половина общие
+#define ASPACE_USER_START   0x0000008000000000UL
+#define ASPACE_USER_END     0x0000800000000000UL
+#define ASPACE_KERNEL_SLOT  256
+
+typedef struct aspace {
+    uint64_t *pml4;
+    uintptr_t pml4_phys;
+    uint16_t asid;
+    uint64_t asid_gen;          // asid действителен, пока совпадает с поколением аллокатора
+    uint64_t kernel_gen;        // версия скопированных записей ядра
+} aspace_t;
+
+void aspace_init(void);
+aspace_t *aspace_create(void);
+void aspace_destroy(aspace_t *as);
+void aspace_switch(aspace_t *as);
+aspace_t *aspace_current(void);
+int aspace_map(aspace_t *as, uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags);
+void aspace_unmap(aspace_t *as, uintptr_t virt, size_t size);
+void aspace_bench(void);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef MM_INTERNAL_H
+#define MM_INTERNAL_H
+
+#include "mem.h"
+
+// Общее состояние аллокаторов (mem.c) и таблиц страниц (paging.c)
+extern mm_struct mm;
+
+static inline page_t *pfn_to_page(unsigned long pfn) {
+    return &mm.mem_map[pfn - mm.start_pfn];
+}
+
+static inline unsigned long page_to_pfn(const page_t *page) {
+    return mm.start_pfn + (unsigned long)(page - mm.mem_map);
+}
+
+static inline page_t *phys_to_page(uint64_t phys) {
+    unsigned long pfn = phys >> PAGE_SHIFT;
+    if (pfn < mm.start_pfn || pfn >= mm.start_pfn + mm.nr_pages)
+        return NULL;
+        
+    return pfn_to_page(pfn);
+}
+
+uint64_t mm_early_alloc(size_t size, uint64_t limit);
+bool migrate_page(page_t *page, void *new_addr);
+
+bool paging_init_direct_map(uint64_t max_addr);
+void paging_init(void);
+
+#endif
@@ -1,43 +1,131 @@
-#include "mem.h"
+#include "internal.h"
+#include "vmalloc.h"
+#include "pagecache.h"
 #include "string.h"
 #include "assert.h"
 #include "stdio.h"
 #include "stddef.h"
+#include "../boot/multiboot2.h"
 
-static mm_struct mm = {0};
+extern char kernel_start[], kernel_end[];
 
-static const char *names[] = {
-    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
-    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+mm_struct mm = {0};
+
+static const char *mm_tag_names[MM_NR_TAGS] = {
+    "other", "pros", "fat32", "vbe", "pci"
+};
+
+// Классы размеров: степени двойки и промежуточные 1.5 * 2^n
+static const struct {
+    const char *name;
+    size_t size;
+} kmalloc_info[KMALLOC_NR_CACHES] = {
+    {"kmalloc-16", 16},       {"kmalloc-24", 24},
+    {"kmalloc-32", 32},       {"kmalloc-48", 48},
+    {"kmalloc-64", 64},       {"kmalloc-96", 96},
+    {"kmalloc-128", 128},     {"kmalloc-192", 192},
+    {"kmalloc-256", 256},     {"kmalloc-384", 384},
+    {"kmalloc-512", 512},     {"kmalloc-768", 768},
+    {"kmalloc-1024", 1024},   {"kmalloc-1536", 1536},
+    {"kmalloc-2048", 2048},   {"kmalloc-3072", 3072},
+    {"kmalloc-4096", 4096},   {"kmalloc-6144", 6144},
+    {"kmalloc-8192", 8192},   {"kmalloc-12288", 12288},
+    {"kmalloc-16384", 16384}, {"kmalloc-24576", 24576},
+    {"kmalloc-32768", 32768}
 };
-static size_t sizes[] = {16, 32, 64, 128, 256, 512, 1024, 2048};
+
+// Индекс класса для размеров до 192 байт, по (size + 7) / 8
+static const uint8_t kmalloc_size_index[25] = {
+    0, 0, 0, 1, 2, 3, 3, 4, 4, 5, 5, 5, 5,
+    6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7
+};
+
+static inline unsigned int kmalloc_index(size_t size) {
+    if (size <= 192)
+        return kmalloc_size_index[(size + 7) >> 3];
+        
+    // 2^(n-1) < size <= 2^n: класс либо 3 * 2^(n-2), либо 2^n
+    unsigned int n = 64 - __builtin_clzl(size - 1);
+    return size <= (3UL << (n - 2)) ? 2 * n - 9 : 2 * n - 8;
+}
+
+// Размер, который занял бы объект при старых классах-степенях двойки
+static size_t kmalloc_pow2_size(size_t size) {
+    if (size > 2048)
+        return PAGE_SIZE << get_order(size);
+        
+    size_t pow2 = SLAB_MIN_SIZE;
+    while (pow2 < size)
+        pow2 <<= 1;
+    return pow2;
+}
+
+// ================= Page Descriptors =================
+
+page_t *virt_to_page(const void *addr) {
+    return pfn_to_page(((uintptr_t)addr - mm.phys_offset) >> PAGE_SHIFT);
+}
+
+void *page_address(const page_t *page) {
+    return (void *)phys_to_virt(page_to_pfn(page) << PAGE_SHIFT);
+}
+
+static inline buddy_t *pfn_zone(unsigned long pfn) {
+    if (pfn < (ZONE_DMA_LIMIT >> PAGE_SHIFT))
+        return &mm.zones[ZONE_DMA];
+    if (pfn < (ZONE_DMA32_LIMIT >> PAGE_SHIFT))
+        return &mm.zones[ZONE_DMA32];
+    return &mm.zones[ZONE_NORMAL];
+}
 
 // ================= Buddy Allocator =================
 
-static void buddy_init(buddy_t *buddy, uintptr_t base, size_t size) {
+static inline void buddy_list_add(buddy_t *buddy, page_t *page, int order) {
+    page->order = order;
+    page->refcount = 0;
+    page->flags |= PG_buddy;
+    list_add(&page->list, &buddy->free_area[order]);
+    buddy->nr_blocks[order]++;
+}
+
+static inline void buddy_list_del(buddy_t *buddy, page_t *page) {
+    list_del(&page->list);
+    buddy->nr_blocks[page->order]--;
+    page->flags &= ~PG_buddy;
+}
+
+static void buddy_init(buddy_t *buddy, const char *name, unsigned long start_pfn, unsigned long end_pfn) {
     memset(buddy, 0, sizeof(*buddy));
-    buddy->base = base;
-    buddy->size = size;
-    buddy->nr_free = size / PAGE_SIZE;
+    buddy->name = name;
+    buddy->start_pfn = start_pfn;
+    buddy->end_pfn = end_pfn > start_pfn ? end_pfn : start_pfn;
     
     for (int i = 0; i <= MAX_ORDER; i++) {
         INIT_LIST_HEAD(&buddy->free_area[i]);
     }
+}
+
+static void buddy_add_range(buddy_t *buddy, unsigned long start_pfn, unsigned long end_pfn) {
+    for (unsigned long pfn = start_pfn; pfn < end_pfn; pfn++) {
+        page_t *page = pfn_to_page(pfn);
+        page->flags &= ~PG_reserved;
+        page->refcount = 0;
+    }
     
-    int order = MAX_ORDER;
-    while (order >= 0) {
-        size_t block_size = PAGE_SIZE << order;
-        if (size >= block_size) {
-            page_t *page = (page_t *)base;
-            page->order = order;
-            page->refcount = 0;
-            page->flags = 0;
-            list_add(&page->list, &buddy->free_area[order]);
-            base += block_size;
-            size -= block_size;
-        } else {
+    // Блоки должны быть выровнены по своему размеру, иначе pfn ^ (1 << order)
+    // не найдёт соседа
+    unsigned long pfn = start_pfn;
+    while (pfn < end_pfn) {
+        int order = MAX_ORDER;
+        while (order > 0 && ((pfn & ((1UL << order) - 1)) || 
+                             pfn + (1UL << order) > end_pfn)) {
             order--;
         }
+        
+        buddy_list_add(buddy, pfn_to_page(pfn), order);
+        buddy->nr_free += 1UL << order;
+        buddy->managed += 1UL << order;
+        pfn += 1UL << order;
     }
 }
 
@@ -54,86 +142,170 @@ static void *buddy_alloc(buddy_t *buddy, int order) {
     if (current_order > MAX_ORDER)
         return NULL;
     
-    list_head_t *list = buddy->free_area[current_order].next;
-    list_del(list);
-    page_t *page = container_of(list, page_t, list);
+    page_t *page = list_first_entry(&buddy->free_area[current_order], page_t, list);
+    buddy_list_del(buddy, page);
     
     while (current_order > order) {
         current_order--;
-        page_t *buddy_page = (page_t *)((uintptr_t)page + (PAGE_SIZE << current_order));
-        
-        buddy_page->order = current_order;
-        buddy_page->refcount = 0;
-        buddy_page->flags = 0;
-        list_add(&buddy_page->list, &buddy->free_area[current_order]);
+        buddy_list_add(buddy, page + (1UL << current_order), current_order);
     }
     
     page->order = order;
     page->refcount = 1;
     buddy->nr_free -= (1 << order);
-    return (void *)page;
+    return page_address(page);
 }
 
 static void buddy_free(buddy_t *buddy, void *addr, int order) {
     if (!addr || order > MAX_ORDER || order < 0)
         return;
         
-    page_t *page = (page_t *)addr;
-    uintptr_t page_addr = (uintptr_t)page;
+    page_t *page = virt_to_page(addr);
+    unsigned long pfn = page_to_pfn(page);
+    unsigned long nr_pages = 1UL << order;
+    
+    page->refcount = 0;
+    page->flags &= ~PG_movable;
     
     while (order < MAX_ORDER) {
-        uintptr_t buddy_addr = page_addr ^ (PAGE_SIZE << order);
-        page_t *buddy_page = (page_t *)buddy_addr;
+        unsigned long buddy_pfn = pfn ^ (1UL << order);
         
-        if ((int)buddy_page->order != order || buddy_page->refcount != 0)
+        if (buddy_pfn < buddy->start_pfn || buddy_pfn >= buddy->end_pfn)
             break;
             
-        list_head_t *pos, *n;
-        bool found = false;
-        
-        list_for_each_safe(pos, n, &buddy->free_area[order]) {
-            page_t *p = container_of(pos, page_t, list);
-            if (p == buddy_page) {
-                list_del(pos);
-                found = true;
-                break;
-            }
-        }
-        
-        if (!found)
+        page_t *buddy_page = pfn_to_page(buddy_pfn);
+        if (!(buddy_page->flags & PG_buddy) || (int)buddy_page->order != order)
             break;
             
-        if (page_addr > buddy_addr)
-            page = buddy_page;
-            
-        page_addr &= ~((PAGE_SIZE << order) - 1);
+        buddy_list_del(buddy, buddy_page);
+        pfn &= buddy_pfn;
         order++;
     }
     
-    page->order = order;
-    page->refcount = 0;
-    list_add(&page->list, &buddy->free_area[order]);
-    buddy->nr_free += (1 << order);
+    buddy_list_add(buddy, pfn_to_page(pfn), order);
+    buddy->nr_free += nr_pages;
+}
+
+// Меняет порядок занятого блока без переноса: лишние хвостовые половины
+// возвращаются в списки, при росте поглощаются свободные соседи сверху
+static bool buddy_resize(buddy_t *buddy, page_t *page, int new_order) {
+    int order = page->order;
+    unsigned long pfn = page_to_pfn(page);
+    
+    if (new_order > MAX_ORDER)
+        return false;
+        
+    if (new_order <= order) {
+        while (order > new_order) {
+            order--;
+            buddy_free(buddy, page_address(page + (1UL << order)), order);
+        }
+        page->order = order;
+        return true;
+    }
+    
+    // Блок должен быть младшей половиной, а сосед - свободным блоком того же порядка
+    for (int o = order; o < new_order; o++) {
+        unsigned long buddy_pfn = pfn + (1UL << o);
+        
+        if ((pfn & (1UL << o)) || buddy_pfn >= buddy->end_pfn)
+            return false;
+            
+        page_t *buddy_page = pfn_to_page(buddy_pfn);
+        if (!(buddy_page->flags & PG_buddy) || (int)buddy_page->order != o)
+            return false;
+    }
+    
+    for (int o = order; o < new_order; o++) {
+        buddy_list_del(buddy, pfn_to_page(pfn + (1UL << o)));
+        buddy->nr_free -= 1UL << o;
+    }
+    
+    page->order = new_order;
+    return true;
 }
 
 // ================= Slab Allocator =================
 
+// Указатель freelist хранится по смещению offset: для кэшей с конструктором
+// он лежит за объектом, чтобы не портить инициализированное состояние
+static inline void **obj_freeptr(kmem_cache_t *cache, void *obj) {
+    return (void **)((char *)obj + cache->offset);
+}
+
+static inline bool is_kmalloc_cache(const kmem_cache_t *cache) {
+    return cache >= &mm.kmalloc_caches[0] && cache < &mm.kmalloc_caches[KMALLOC_NR_CACHES];
+}
+
+// За slab_t: байт тега на каждый объект, у kmalloc ещё uint16_t запрошенного размера
+static inline size_t slab_meta_size(kmem_cache_t *cache, size_t objs) {
+    return is_kmalloc_cache(cache) ? ALIGN_UP(objs, 2) + objs * sizeof(uint16_t) : objs;
+}
+
+static inline size_t slab_header_size(kmem_cache_t *cache, size_t objs) {
+    return cache->off_slab ? 0 : ALIGN_UP(sizeof(slab_t) + slab_meta_size(cache, objs), cache->align);
+}
+
+static size_t slab_nr_objs(kmem_cache_t *cache, size_t slab_size) {
+    size_t meta = is_kmalloc_cache(cache) ? 1 + sizeof(uint16_t) : 1;
+    size_t base = cache->off_slab ? 0 : sizeof(slab_t) + meta;
+    if (slab_size < base + cache->obj_size)
+        return 0;
+        
+    size_t objs = (slab_size - base) / (cache->obj_size + (cache->off_slab ? 0 : meta)) + 1;
+    while (objs && slab_header_size(cache, objs) + objs * cache->obj_size > slab_size)
+        objs--;
+    return objs;
+}
+
+static inline unsigned int slab_obj_index(kmem_cache_t *cache, slab_t *slab, const void *obj) {
+    return ((const char *)obj - (const char *)slab->s_mem) / cache->obj_size;
+}
+
 static slab_t *kmem_cache_grow(kmem_cache_t *cache) {
-    slab_t *slab = (slab_t *)page_alloc(cache->order);
-    if (!slab)
+    void *mem = page_alloc(cache->order);
+    if (!mem)
         return NULL;
         
+    size_t colour = cache->colour_next * cache->colour_off;
+    if (++cache->colour_next >= cache->colour)
+        cache->colour_next = 0;
+        
+    slab_t *slab;
+    if (cache->off_slab) {
+        slab = (slab_t *)kmalloc(sizeof(slab_t) + slab_meta_size(cache, cache->objs_per_slab));
+        if (!slab) {
+            page_free(mem, cache->order);
+            return NULL;
+        }
+        slab->s_mem = (char *)mem + colour;
+    } else {
+        slab = (slab_t *)mem;
+        slab->s_mem = (char *)mem + slab_header_size(cache, cache->objs_per_slab) + colour;
+    }
+        
     INIT_LIST_HEAD(&slab->list);
-    slab->freelist = (void *)(slab + 1);
+    slab->freelist = slab->s_mem;
     slab->inuse = 0;
     slab->free = cache->objs_per_slab;
     slab->cache = cache;
+    slab->sizes = is_kmalloc_cache(cache) ? 
+                  (uint16_t *)(slab->tags + ALIGN_UP(cache->objs_per_slab, 2)) : NULL;
+    
+    page_t *page = virt_to_page(mem);
+    for (unsigned int i = 0; i < (1U << cache->order); i++) {
+        page[i].flags |= PG_slab;
+        page[i].slab = slab;
+    }
     
-    char *p = (char *)(slab + 1);
-    for (unsigned int i = 0; i < cache->objs_per_slab - 1; i++) {
-        *(void **)(p + i * cache->obj_size) = p + (i + 1) * cache->obj_size;
+    char *p = (char *)slab->s_mem;
+    for (unsigned int i = 0; i < cache->objs_per_slab; i++) {
+        void *obj = p + i * cache->obj_size;
+        if (cache->ctor)
+            cache->ctor(obj);
+        *obj_freeptr(cache, obj) = (i + 1 < cache->objs_per_slab) ? 
+                                   p + (i + 1) * cache->obj_size : NULL;
     }
-    *(void **)(p + (cache->objs_per_slab - 1) * cache->obj_size) = NULL;
     
     cache->pages += (1 << cache->order);
     cache->objects += cache->objs_per_slab;
@@ -141,23 +313,97 @@ static slab_t *kmem_cache_grow(kmem_cache_t *cache) {
     return slab;
 }
 
-static void kmem_cache_init(kmem_cache_t *cache, const char *name, size_t size) {
-    strncpy(cache->name, name, sizeof(cache->name)-1);
-    cache->obj_size = ALIGN_UP(size, sizeof(void *));
+static void kmem_cache_free_slab(kmem_cache_t *cache, slab_t *slab) {
+    if (cache->dtor) {
+        for (unsigned int i = 0; i < cache->objs_per_slab; i++) {
+            cache->dtor((char *)slab->s_mem + i * cache->obj_size);
+        }
+    }
+    
+    void *mem = (void *)((uintptr_t)slab->s_mem & ~((PAGE_SIZE << cache->order) - 1));
+    page_t *page = virt_to_page(mem);
+    for (unsigned int i = 0; i < (1U << cache->order); i++) {
+        page[i].flags &= ~PG_slab;
+        page[i].slab = NULL;
+    }
+    
+    cache->pages -= (1 << cache->order);
+    cache->objects -= cache->objs_per_slab;
+    page_free(mem, cache->order);
+    
+    if (cache->off_slab)
+        kfree(slab);
+}
 
-    cache->order = 0;
+static void kmem_cache_init(kmem_cache_t *cache, const char *name, size_t size, size_t align,
+                            void (*ctor)(void *), void (*dtor)(void *)) {
+    strncpy(cache->name, name, sizeof(cache->name)-1);
+    cache->align = align < sizeof(void *) ? sizeof(void *) : align;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    
+    if (ctor) {
+        cache->offset = ALIGN_UP(size, sizeof(void *));
+        cache->obj_size = ALIGN_UP(cache->offset + sizeof(void *), cache->align);
+    } else {
+        cache->offset = 0;
+        cache->obj_size = ALIGN_UP(size, cache->align);
+    }
     
-    while ((size_t)(PAGE_SIZE << cache->order) < cache->obj_size * 16 && 
-           cache->order < (unsigned int)MAX_ORDER) {
-        cache->order++;
+    // Крупные объекты держат slab_t отдельно, чтобы заголовок не съедал
+    // целый объект в каждом slab
+    cache->off_slab = cache->obj_size >= SLAB_OFF_SLAB_SIZE;
+
+    // Наименьший порядок, при котором в slab хотя бы 8 объектов
+    // и теряется не больше 1/8 места
+    for (cache->order = 0; cache->order < SLAB_MAX_ORDER; cache->order++) {
+        size_t slab_size = PAGE_SIZE << cache->order;
+        size_t objs = slab_nr_objs(cache, slab_size);
+        if (objs == 0)
+            continue;
+            
+        size_t left = slab_size - slab_header_size(cache, objs) - objs * cache->obj_size;
+        if (objs >= 8 && left * 8 <= slab_size)
+            break;
     }
     
-    cache->objs_per_slab = (PAGE_SIZE << cache->order) / cache->obj_size;
+    size_t slab_size = PAGE_SIZE << cache->order;
+    cache->objs_per_slab = slab_nr_objs(cache, slab_size);
+    
+    // Остаток slab'а раздаётся как смещение первого объекта, по кэш-линии
+    // на каждый следующий slab
+    size_t left = slab_size - slab_header_size(cache, cache->objs_per_slab) - 
+                  cache->objs_per_slab * cache->obj_size;
+    cache->colour_off = cache->align > CACHE_LINE_SIZE ? cache->align : CACHE_LINE_SIZE;
+    cache->colour = left / cache->colour_off + 1;
+    cache->colour_next = 0;
+    
     INIT_LIST_HEAD(&cache->slabs_full);
     INIT_LIST_HEAD(&cache->slabs_partial);
     INIT_LIST_HEAD(&cache->slabs_free);
     cache->objects = 0;
+    cache->active = 0;
     cache->pages = 0;
+    cache->free_slabs = 0;
+    cache->free_limit = SLAB_FREE_LIMIT;
+    list_add(&cache->list, &mm.caches);
+}
+
+// Возвращает в buddy пустые slab'ы сверх keep, результат - число страниц.
+// Освобождаются самые давние: только что опустевший slab ещё горячий в кэше
+static unsigned long kmem_cache_shrink_to(kmem_cache_t *cache, unsigned int keep) {
+    unsigned long reclaimed = 0;
+    
+    while (cache->free_slabs > keep) {
+        slab_t *slab = list_last_entry(&cache->slabs_free, slab_t, list);
+        list_del(&slab->list);
+        cache->free_slabs--;
+        kmem_cache_free_slab(cache, slab);
+        reclaimed += 1UL << cache->order;
+    }
+    
+    mm.shrink_reclaimed += reclaimed;
+    return reclaimed;
 }
 
 void *kmem_cache_alloc(kmem_cache_t *cache) {
@@ -169,6 +415,7 @@ void *kmem_cache_alloc(kmem_cache_t *cache) {
         slab = list_first_entry(&cache->slabs_free, slab_t, list);
         list_del(&slab->list);
         list_add(&slab->list, &cache->slabs_partial);
+        cache->free_slabs--;
     } else {
         slab = kmem_cache_grow(cache);
         if (!slab)
@@ -177,9 +424,10 @@ void *kmem_cache_alloc(kmem_cache_t *cache) {
     }
     
     void *obj = slab->freelist;
-    slab->freelist = *(void **)obj;
+    slab->freelist = *obj_freeptr(cache, obj);
     slab->inuse++;
     slab->free--;
+    cache->active++;
     
     if (slab->free == 0) {
         list_del(&slab->list);
@@ -193,36 +441,45 @@ void kmem_cache_free(kmem_cache_t *cache, void *obj) {
     if (!obj || !cache)
         return;
         
-    slab_t *slab = (slab_t *)((uintptr_t)obj & PAGE_MASK);
+    page_t *page = virt_to_page(obj);
+    slab_t *slab = page->slab;
     
-    if (slab->cache != cache) {
+    if (!(page->flags & PG_slab) || slab->cache != cache) {
         printf("kmem_cache_free: Wrong cache for object %p\n", obj);
         return;
     }
     
-    *(void **)obj = slab->freelist;
+    *obj_freeptr(cache, obj) = slab->freelist;
     slab->freelist = obj;
     slab->inuse--;
     slab->free++;
+    cache->active--;
     
     if (slab->inuse == 0) {
         list_del(&slab->list);
         list_add(&slab->list, &cache->slabs_free);
+        cache->free_slabs++;
+        if (cache->free_slabs > cache->free_limit)
+            kmem_cache_shrink_to(cache, cache->free_limit);
     } else if (slab->inuse == cache->objs_per_slab - 1) {
         list_del(&slab->list);
         list_add(&slab->list, &cache->slabs_partial);
     }
 }
 
-kmem_cache_t *kmem_cache_create(const char *name, size_t size) {
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                void (*ctor)(void *), void (*dtor)(void *)) {
     if (size > SLAB_MAX_SIZE || size < SLAB_MIN_SIZE)
         return NULL;
         
+    if (align & (align - 1) || align > PAGE_SIZE)
+        return NULL;
+        
     kmem_cache_t *cache = (kmem_cache_t *)kmalloc(sizeof(kmem_cache_t));
     if (!cache)
         return NULL;
         
-    kmem_cache_init(cache, name, size);
+    kmem_cache_init(cache, name, size, align, ctor, dtor);
     return cache;
 }
 
@@ -232,71 +489,517 @@ void kmem_cache_destroy(kmem_cache_t *cache) {
         
     slab_t *slab, *tmp;
     list_for_each_entry_safe(slab, tmp, &cache->slabs_free, list) {
-        page_free(slab, cache->order);
+        kmem_cache_free_slab(cache, slab);
     }
     list_for_each_entry_safe(slab, tmp, &cache->slabs_partial, list) {
-        page_free(slab, cache->order);
+        kmem_cache_free_slab(cache, slab);
     }
     list_for_each_entry_safe(slab, tmp, &cache->slabs_full, list) {
-        page_free(slab, cache->order);
+        kmem_cache_free_slab(cache, slab);
     }
     
+    list_del(&cache->list);
     kfree(cache);
 }
 
+unsigned long kmem_cache_shrink(kmem_cache_t *cache) {
+    if (!cache)
+        return 0;
+        
+    return kmem_cache_shrink_to(cache, cache->free_limit);
+}
+
+void kmem_cache_set_free_limit(kmem_cache_t *cache, unsigned int limit) {
+    if (!cache)
+        return;
+        
+    cache->free_limit = limit;
+    kmem_cache_shrink_to(cache, limit);
+}
+
+// Вызывается при нехватке памяти: отдаёт все пустые slab'ы всех кэшей,
+// не оглядываясь на free_limit, который kmem_cache_free держит в обычной работе
+unsigned long kmem_shrink_all(void) {
+    unsigned long reclaimed = 0;
+    kmem_cache_t *cache;
+    
+    list_for_each_entry(cache, &mm.caches, list) {
+        reclaimed += kmem_cache_shrink_to(cache, 0);
+    }
+    
+    return reclaimed;
+}
+
+// ================= Boot Memory =================
+
+static void mm_add_usable(uint64_t start, uint64_t end) {
+    start = ALIGN_UP(start, PAGE_SIZE);
+    end = ALIGN_DOWN(end, PAGE_SIZE);
+    
+    // Ниже 1 МБ - BIOS и VGA
+    if (start < MM_LOW_LIMIT)
+        start = MM_LOW_LIMIT;
+        
+    if (end <= start || mm.nr_usable >= MM_MAX_REGIONS)
+        return;
+        
+    mm.usable[mm.nr_usable].start = start;
+    mm.usable[mm.nr_usable].end = end;
+    mm.nr_usable++;
+}
+
+static bool mm_reserve(uint64_t start, uint64_t end) {
+    if (end <= start || mm.nr_reserved >= MM_MAX_REGIONS)
+        return false;
+        
+    mm.reserved[mm.nr_reserved].start = ALIGN_DOWN(start, PAGE_SIZE);
+    mm.reserved[mm.nr_reserved].end = ALIGN_UP(end, PAGE_SIZE);
+    mm.nr_reserved++;
+    return true;
+}
+
+// Выделение до запуска buddy: первый участок usable ниже limit, не задевающий reserved
+uint64_t mm_early_alloc(size_t size, uint64_t limit) {
+    size = ALIGN_UP(size, PAGE_SIZE);
+    
+    for (int i = 0; i < mm.nr_usable; i++) {
+        uint64_t addr = mm.usable[i].start;
+        uint64_t end = mm.usable[i].end < limit ? mm.usable[i].end : limit;
+        
+        while (addr + size <= end) {
+            int j;
+            for (j = 0; j < mm.nr_reserved; j++) {
+                if (addr < mm.reserved[j].end && addr + size > mm.reserved[j].start)
+                    break;
+            }
+            
+            if (j == mm.nr_reserved)
+                return mm_reserve(addr, addr + size) ? addr : 0;
+                
+            addr = mm.reserved[j].end;
+        }
+    }
+    
+    return 0;
+}
+
+// Отдаёт [start, end) в зоны buddy, вырезая зарезервированные участки
+static void mm_free_range(uint64_t start, uint64_t end, int first) {
+    for (int j = first; j < mm.nr_reserved; j++) {
+        mm_region_t *r = &mm.reserved[j];
+        if (start < r->end && end > r->start) {
+            if (start < r->start)
+                mm_free_range(start, r->start, j + 1);
+            if (end > r->end)
+                mm_free_range(r->end, end, j + 1);
+            return;
+        }
+    }
+    
+    for (int z = 0; z < MAX_NR_ZONES; z++) {
+        buddy_t *zone = &mm.zones[z];
+        unsigned long s = start >> PAGE_SHIFT;
+        unsigned long e = end >> PAGE_SHIFT;
+        
+        if (s < zone->start_pfn)
+            s = zone->start_pfn;
+        if (e > zone->end_pfn)
+            e = zone->end_pfn;
+        if (s < e)
+            buddy_add_range(zone, s, e);
+    }
+}
+
+static void mm_parse_memory_map(uint32_t magic, void *mbi) {
+    struct multiboot_tag_mmap *mmap = get_memory_map(magic, mbi);
+    
+    if (!mmap) {
+        printf("No multiboot memory map, assuming %u MB\n", 
+              (unsigned int)(MM_FALLBACK_END >> 20));
+        mm_add_usable(MM_LOW_LIMIT, MM_FALLBACK_END);
+        return;
+    }
+    
+    uint8_t *entry = (uint8_t *)mmap->entries;
+    uint8_t *end = (uint8_t *)mmap + mmap->size;
+    
+    for (; entry < end; entry += mmap->entry_size) {
+        struct multiboot_mmap_entry *e = (struct multiboot_mmap_entry *)entry;
+        if (e->type == MULTIBOOT_MEMORY_AVAILABLE)
+            mm_add_usable(e->addr, e->addr + e->len);
+    }
+    
+    mm_reserve((uintptr_t)mbi, (uintptr_t)mbi + get_multiboot_info_size(mbi));
+    
+    struct framebuffer_info *fb = get_framebuffer_info(magic, mbi);
+    if (fb) {
+        uintptr_t fb_start = (uintptr_t)fb->address;
+        mm_reserve(fb_start, fb_start + (uint64_t)fb->pitch * fb->height);
+    }
+}
+
+// ================= Zeroed Pages =================
+
+// Обнуление в обход кэша: страница из пула может не понадобиться ещё долго
+static void clear_page_nt(void *addr) {
+    uint64_t n = PAGE_SIZE / 64;
+    
+    asm volatile(
+        "pxor %%xmm0, %%xmm0\n"
+        "1:\n"
+        "movntdq %%xmm0, 0(%0)\n"
+        "movntdq %%xmm0, 16(%0)\n"
+        "movntdq %%xmm0, 32(%0)\n"
+        "movntdq %%xmm0, 48(%0)\n"
+        "add $64, %0\n"
+        "dec %1\n"
+        "jnz 1b\n"
+        : "+r" (addr), "+r" (n)
+        :
+        : "xmm0", "memory"
+    );
+}
+
+static void *zero_pool_pop(void) {
+    if (list_empty(&mm.zero_pool))
+        return NULL;
+        
+    page_t *page = list_first_entry(&mm.zero_pool, page_t, list);
+    list_del(&page->list);
+    page->flags &= ~PG_movable;
+    mm.zero_nr--;
+    return page_address(page);
+}
+
+// Страница пула ничего не хранит: вместо копирования новая просто обнуляется
+static bool zero_pool_migrate(page_t *page, void *new_addr) {
+    memset(new_addr, 0, PAGE_SIZE);
+    list_del(&page->list);
+    list_add(&virt_to_page(new_addr)->list, &mm.zero_pool);
+    return true;
+}
+
+static const movable_ops_t zero_pool_mops = {
+    .migrate = zero_pool_migrate,
+};
+
+static unsigned long zero_pool_drain(void) {
+    unsigned long freed = 0;
+    void *addr;
+    
+    while ((addr = zero_pool_pop()) != NULL) {
+        page_free(addr, 0);
+        freed++;
+    }
+    
+    return freed;
+}
+
+// Дозаполняет пул обнулённых страниц; вызывается, когда процессору нечего делать
+void mm_idle(void) {
+    if (!mm.initialized || mm.zero_nr >= ZERO_POOL_TARGET)
+        return;
+        
+    for (int i = 0; i < ZERO_POOL_BATCH && mm.zero_nr < ZERO_POOL_TARGET; i++) {
+        // Без сжатия slab и без зоны DMA: пул не должен отнимать память
+        void *addr = buddy_alloc(&mm.zones[ZONE_NORMAL], 0);
+        if (!addr)
+            addr = buddy_alloc(&mm.zones[ZONE_DMA32], 0);
+        if (!addr)
+            break;
+            
+        clear_page_nt(addr);
+        set_page_movable(addr, &zero_pool_mops, NULL, 0);
+        list_add(&virt_to_page(addr)->list, &mm.zero_pool);
+        mm.zero_nr++;
+    }
+    
+    asm volatile("sfence" : : : "memory");
+}
+
+// ================= Compaction =================
+
+void set_page_movable(void *addr, const movable_ops_t *ops, void *owner, unsigned long index) {
+    page_t *page = virt_to_page(addr);
+    page->mops = ops;
+    page->owner = owner;
+    page->index = index;
+    page->flags |= PG_movable;
+}
+
+void clear_page_movable(void *addr) {
+    page_t *page = virt_to_page(addr);
+    page->flags &= ~PG_movable;
+    page->mops = NULL;
+    page->owner = NULL;
+}
+
+bool migrate_page(page_t *page, void *new_addr) {
+    set_page_movable(new_addr, page->mops, page->owner, page->index);
+    
+    if (!page->mops->migrate(page, new_addr)) {
+        clear_page_movable(new_addr);
+        return false;
+    }
+    
+    clear_page_movable(page_address(page));
+    return true;
+}
+
+// Выбирает выровненный блок порядка order, где всё либо свободно, либо PG_movable,
+// с наименьшим числом страниц для переноса
+static unsigned long compact_find_block(buddy_t *zone, int order) {
+    unsigned long size = 1UL << order;
+    unsigned long best = 0, best_movable = ~0UL;
+    
+    for (unsigned long base = ALIGN_UP(zone->start_pfn, size); 
+         base + size <= zone->end_pfn; base += size) {
+        unsigned long pfn = base, movable = 0, free = 0;
+        
+        while (pfn < base + size) {
+            page_t *page = pfn_to_page(pfn);
+            
+            if (page->flags & PG_buddy) {
+                free += 1UL << page->order;
+                pfn += 1UL << page->order;
+            } else if ((page->flags & PG_movable) && page->refcount == 1) {
+                // Разделяемую страницу держат чужие PTE, переносить её нельзя
+                movable++;
+                pfn++;
+            } else {
+                break;
+            }
+        }
+        
+        if (pfn < base + size || movable == 0)
+            continue;
+            
+        // Новые страницы берутся из той же зоны, но снаружи блока
+        if (movable < best_movable && zone->nr_free - free >= movable) {
+            best = base;
+            best_movable = movable;
+        }
+    }
+    
+    return best_movable == ~0UL ? 0 : best;
+}
+
+static bool compact_zone(buddy_t *zone, int order) {
+    unsigned long base = compact_find_block(zone, order);
+    if (!base) {
+        mm.compact_fail++;
+        return false;
+    }
+    
+    unsigned long end = base + (1UL << order);
+    list_head_t isolated;
+    INIT_LIST_HEAD(&isolated);
+    
+    // Свободные куски блока убираются из списков, чтобы buddy_alloc не отдал их
+    // под новые страницы; туда же попадают перенесённые старые страницы
+    for (unsigned long pfn = base; pfn < end; pfn++) {
+        page_t *page = pfn_to_page(pfn);
+        if (!(page->flags & PG_buddy))
+            continue;
+            
+        unsigned long nr = 1UL << page->order;
+        buddy_list_del(zone, page);
+        zone->nr_free -= nr;
+        list_add(&page->list, &isolated);
+        pfn += nr - 1;
+    }
+    
+    bool ok = true;
+    for (unsigned long pfn = base; pfn < end; pfn++) {
+        page_t *page = pfn_to_page(pfn);
+        if (!(page->flags & PG_movable))
+            continue;
+            
+        void *new_addr = buddy_alloc(zone, 0);
+        if (!new_addr || !migrate_page(page, new_addr)) {
+            if (new_addr)
+                buddy_free(zone, new_addr, 0);
+            ok = false;
+            break;
+        }
+        
+        mm.compact_migrated++;
+        page->order = 0;
+        list_add(&page->list, &isolated);
+    }
+    
+    list_head_t *pos, *n;
+    list_for_each_safe(pos, n, &isolated) {
+        page_t *page = container_of(pos, page_t, list);
+        list_del(pos);
+        buddy_free(zone, page_address(page), page->order);
+    }
+    
+    if (ok)
+        mm.compact_success++;
+    else
+        mm.compact_fail++;
+    return ok;
+}
+
 // ================= Memory Manager =================
 
-void mm_init(uintptr_t phys_mem_start, uintptr_t phys_mem_end) {
+void mm_init(uint32_t magic, void *mbi) {
     if (mm.initialized)
         return;
     
     mm.phys_offset = 0;
-    uintptr_t virt_start = phys_to_virt(phys_mem_start);
-    uintptr_t virt_end = phys_to_virt(phys_mem_end);
+    mm.nr_usable = 0;
+    mm.nr_reserved = 0;
+    
+    // Образ ядра вместе с загрузочными таблицами страниц (они в .bss)
+    mm_reserve((uintptr_t)kernel_start, (uintptr_t)kernel_end);
+    mm_parse_memory_map(magic, mbi);
+    
+    if (mm.nr_usable == 0) {
+        printf("Error: No usable memory\n");
+        return;
+    }
+    
+    uint64_t min_addr = mm.usable[0].start, max_addr = mm.usable[0].end;
+    for (int i = 1; i < mm.nr_usable; i++) {
+        if (mm.usable[i].start < min_addr)
+            min_addr = mm.usable[i].start;
+        if (mm.usable[i].end > max_addr)
+            max_addr = mm.usable[i].end;
+    }
+    
+    if (!paging_init_direct_map(max_addr)) {
+        printf("Error: No room for direct map page tables\n");
+        return;
+    }
     
-    virt_start = ALIGN_UP(virt_start, PAGE_SIZE);
-    virt_end = ALIGN_DOWN(virt_end, PAGE_SIZE);
+    // mem_map описывает все страницы от младшей до старшей usable,
+    // дыры остаются помеченными PG_reserved
+    mm.start_pfn = min_addr >> PAGE_SHIFT;
+    mm.nr_pages = (max_addr - min_addr) >> PAGE_SHIFT;
     
-    if (virt_end <= virt_start) {
-        printf("Error: Invalid memory range: 0x%x - 0x%x\n", virt_start, virt_end);
+    size_t map_size = ALIGN_UP(mm.nr_pages * sizeof(page_t), PAGE_SIZE);
+    uint64_t map_phys = mm_early_alloc(map_size, ~0UL);
+    if (!map_phys) {
+        printf("Error: No room for mem_map (%u KB)\n", (unsigned int)(map_size / 1024));
         return;
     }
     
-    buddy_init(&mm.buddy, virt_start, virt_end - virt_start);
+    mm.mem_map = (page_t *)phys_to_virt(map_phys);
+    memset(mm.mem_map, 0, map_size);
+    for (unsigned long i = 0; i < mm.nr_pages; i++) {
+        mm.mem_map[i].flags = PG_reserved;
+        mm.mem_map[i].refcount = 1;
+    }
+    
+    unsigned long end_pfn = mm.start_pfn + mm.nr_pages;
+    unsigned long dma_pfn = ZONE_DMA_LIMIT >> PAGE_SHIFT;
+    unsigned long dma32_pfn = ZONE_DMA32_LIMIT >> PAGE_SHIFT;
+    
+    buddy_init(&mm.zones[ZONE_DMA], "DMA", mm.start_pfn, 
+               end_pfn < dma_pfn ? end_pfn : dma_pfn);
+    buddy_init(&mm.zones[ZONE_DMA32], "DMA32", mm.start_pfn > dma_pfn ? mm.start_pfn : dma_pfn,
+               end_pfn < dma32_pfn ? end_pfn : dma32_pfn);
+    buddy_init(&mm.zones[ZONE_NORMAL], "Normal", mm.start_pfn > dma32_pfn ? mm.start_pfn : dma32_pfn,
+               end_pfn);
+    
+    for (int i = 0; i < mm.nr_usable; i++) {
+        mm_free_range(mm.usable[i].start, mm.usable[i].end, 0);
+    }
 
-    for (int i = 0; i < 8; i++) {
-        kmem_cache_init(&mm.kmalloc_caches[i], names[i], sizes[i]);
+    INIT_LIST_HEAD(&mm.caches);
+    INIT_LIST_HEAD(&mm.zero_pool);
+    for (int i = 0; i < KMALLOC_NR_CACHES; i++) {
+        kmem_cache_init(&mm.kmalloc_caches[i], kmalloc_info[i].name, 
+                        kmalloc_info[i].size, 0, NULL, NULL);
     }
     
     mm.initialized = true;
+    paging_init();
+    
+    unsigned long total = 0;
+    for (int z = 0; z < MAX_NR_ZONES; z++) {
+        total += mm.zones[z].nr_free;
+        if (mm.zones[z].managed)
+            printf("  Zone %s: %u KB\n", mm.zones[z].name, 
+                  (unsigned int)(mm.zones[z].managed * (PAGE_SIZE / 1024)));
+    }
     printf("Memory manager initialized: %u KB available\n", 
-          (virt_end - virt_start) / 1024);
+          (unsigned int)(total * (PAGE_SIZE / 1024)));
+    printf("  Direct map: %u MB with %s pages%s\n", (unsigned int)(mm.direct_map_end >> 20),
+          mm.direct_map_1g ? "1 GB" : "2 MB", mm.global_pages ? ", global" : "");
 }
 
-void *kmalloc(size_t size) {
+// Учитываются только живые объекты: kfree вычитает то же, что прибавил kmalloc
+static void kmalloc_account(size_t requested, size_t allocated, bool alloc) {
+    if (alloc) {
+        mm.kmalloc_requested += requested;
+        mm.kmalloc_allocated += allocated;
+        mm.kmalloc_pow2 += kmalloc_pow2_size(requested);
+    } else {
+        mm.kmalloc_requested -= requested;
+        mm.kmalloc_allocated -= allocated;
+        mm.kmalloc_pow2 -= kmalloc_pow2_size(requested);
+    }
+}
+
+static void *kmalloc_gfp(size_t size, unsigned int gfp, int tag) {
     if (!mm.initialized)
         return NULL;
         
-    if (size <= SLAB_MAX_SIZE) {
-        for (int i = 0; i < 8; i++) {
-            if (size <= mm.kmalloc_caches[i].obj_size) {
-                return kmem_cache_alloc(&mm.kmalloc_caches[i]);
-            }
-        }
+    if (tag < 0 || tag >= MM_NR_TAGS)
+        tag = MM_TAG_NONE;
+        
+    // Обнулённый объект размером почти со страницу дешевле взять готовой
+    // страницей из пула, чем обнулять объект из slab'а
+    bool from_pool = (gfp & GFP_ZERO) && size > PAGE_SIZE / 2 && size <= PAGE_SIZE &&
+                     !list_empty(&mm.zero_pool);
+        
+    if (size <= KMALLOC_MAX_SIZE && !from_pool) {
+        kmem_cache_t *cache = &mm.kmalloc_caches[kmalloc_index(size)];
+        
+        void *ptr = kmem_cache_alloc(cache);
+        if (!ptr)
+            return NULL;
+            
+        slab_t *slab = virt_to_page(ptr)->slab;
+        unsigned int idx = slab_obj_index(cache, slab, ptr);
+        slab->tags[idx] = tag;
+        slab->sizes[idx] = size;
+        mm.tag_bytes[tag] += cache->obj_size;
+        kmalloc_account(size, cache->obj_size, true);
+        
+        if (gfp & GFP_ZERO)
+            memset(ptr, 0, size);
+        return ptr;
     }
     
-    int order = 0;
-    while ((size_t)(PAGE_SIZE << order) < size && order < MAX_ORDER)
-        order++;
-    
-    return page_alloc(order);
+    int order = get_order(size);
+    void *ptr = alloc_pages(gfp, order);
+    if (ptr) {
+        page_t *page = virt_to_page(ptr);
+        page->tag = tag;
+        page->index = size;
+        mm.tag_bytes[tag] += PAGE_SIZE << order;
+        kmalloc_account(size, PAGE_SIZE << order, true);
+    }
+    return ptr;
+}
+
+void *kmalloc(size_t size) {
+    return kmalloc_gfp(size, GFP_KERNEL, MM_TAG_NONE);
+}
+
+void *kmalloc_tag(size_t size, int tag) {
+    return kmalloc_gfp(size, GFP_KERNEL, tag);
 }
 
 void *kcalloc(size_t n, size_t size) {
-    void *ptr = kmalloc(n * size);
-    if (ptr)
-        memset(ptr, 0, n * size);
-    return ptr;
+    if (size && n > SIZE_MAX / size)
+        return NULL;
+        
+    return kmalloc_gfp(n * size, GFP_ZERO, MM_TAG_NONE);
 }
 
 void *krealloc(void *p, size_t size) {
@@ -308,8 +1011,38 @@ void *krealloc(void *p, size_t size) {
         return NULL;
     }
     
-    size_t old_size = kmalloc_size(p);
-    void *new_ptr = kmalloc(size);
+    page_t *page = virt_to_page(p);
+    size_t old_size;
+    int tag;
+    
+    if (page->flags & PG_slab) {
+        slab_t *slab = page->slab;
+        unsigned int idx = slab_obj_index(slab->cache, slab, p);
+        old_size = slab->cache->obj_size;
+        tag = slab->tags[idx];
+        if (size <= old_size) {
+            kmalloc_account(slab->sizes[idx], old_size, false);
+            kmalloc_account(size, old_size, true);
+            slab->sizes[idx] = size;
+            return p;
+        }
+    } else {
+        old_size = PAGE_SIZE << page->order;
+        tag = page->tag;
+        // Мелкий остаток уходит в slab, а не держит целые страницы
+        if (size > KMALLOC_MAX_SIZE &&
+            buddy_resize(pfn_zone(page_to_pfn(page)), page, get_order(size))) {
+            size_t new_size = PAGE_SIZE << page->order;
+            mm.tag_bytes[tag] += new_size;
+            mm.tag_bytes[tag] -= old_size;
+            kmalloc_account(page->index, old_size, false);
+            kmalloc_account(size, new_size, true);
+            page->index = size;
+            return p;
+        }
+    }
+    
+    void *new_ptr = kmalloc_tag(size, tag);
     if (new_ptr) {
         memcpy(new_ptr, p, old_size < size ? old_size : size);
         kfree(p);
@@ -321,236 +1054,184 @@ void kfree(const void *ptr) {
     if (!ptr || !mm.initialized)
         return;
         
-    for (int i = 0; i < 8; i++) {
-        kmem_cache_t *cache = &mm.kmalloc_caches[i];
-        slab_t *slab;
-        
-        list_for_each_entry(slab, &cache->slabs_full, list) {
-            if ((uintptr_t)ptr >= (uintptr_t)(slab + 1) && 
-                (uintptr_t)ptr < (uintptr_t)(slab + 1) + (PAGE_SIZE << cache->order)) {
-                kmem_cache_free(cache, (void *)ptr);
-                return;
-            }
-        }
+    page_t *page = virt_to_page(ptr);
+    if (page->flags & PG_slab) {
+        slab_t *slab = page->slab;
+        kmem_cache_t *cache = slab->cache;
         
-        list_for_each_entry(slab, &cache->slabs_partial, list) {
-            if ((uintptr_t)ptr >= (uintptr_t)(slab + 1) && 
-                (uintptr_t)ptr < (uintptr_t)(slab + 1) + (PAGE_SIZE << cache->order)) {
-                kmem_cache_free(cache, (void *)ptr);
-                return;
-            }
+        if (is_kmalloc_cache(cache)) {
+            unsigned int idx = slab_obj_index(cache, slab, ptr);
+            mm.tag_bytes[slab->tags[idx]] -= cache->obj_size;
+            kmalloc_account(slab->sizes[idx], cache->obj_size, false);
         }
+        kmem_cache_free(cache, (void *)ptr);
+        return;
     }
     
-    page_t *page = (page_t *)((uintptr_t)ptr & PAGE_MASK);
-    page_free(page, page->order);
+    mm.tag_bytes[page->tag] -= PAGE_SIZE << page->order;
+    kmalloc_account(page->index, PAGE_SIZE << page->order, false);
+    page_free((void *)ptr, page->order);
 }
 
-void *page_alloc(int order) {
+static void *alloc_pages_zones(int zone, int order) {
+    // Старшие зоны отдают память первыми, DMA остаётся тем, кому она нужна
+    for (int z = zone; z >= 0; z--) {
+        void *addr = buddy_alloc(&mm.zones[z], order);
+        if (addr)
+            return addr;
+    }
+    
+    return NULL;
+}
+
+void *alloc_pages(unsigned int gfp, int order) {
     if (!mm.initialized || order > MAX_ORDER || order < 0)
         return NULL;
         
-    return buddy_alloc(&mm.buddy, order);
+    int zone = ZONE_NORMAL;
+    if (gfp & GFP_DMA)
+        zone = ZONE_DMA;
+    else if (gfp & GFP_DMA32)
+        zone = ZONE_DMA32;
+        
+    if ((gfp & GFP_ZERO) && order == 0 && zone == ZONE_NORMAL) {
+        void *addr = zero_pool_pop();
+        if (addr) {
+            mm.zero_hits++;
+            return addr;
+        }
+    }
+    
+    void *addr = alloc_pages_zones(zone, order);
+    
+    // Опрашиваются все три источника: одной страницы из slab'ов может
+    // не хватить, пока пул обнулённых страниц и кэш страниц держат память
+    if (!addr) {
+        unsigned long reclaimed = kmem_shrink_all();
+        reclaimed += zero_pool_drain();
+        reclaimed += pagecache_shrink();
+        if (reclaimed)
+            addr = alloc_pages_zones(zone, order);
+    }
+        
+    // Свободных страниц может хватать, но не одним куском
+    for (int z = zone; !addr && order > 0 && z >= 0; z--) {
+        if (compact_zone(&mm.zones[z], order))
+            addr = buddy_alloc(&mm.zones[z], order);
+    }
+    
+    if (addr && (gfp & GFP_ZERO)) {
+        memset(addr, 0, PAGE_SIZE << order);
+        mm.zero_misses++;
+    }
+        
+    return addr;
+}
+
+void *page_alloc(int order) {
+    return alloc_pages(GFP_KERNEL, order);
 }
 
 void page_free(void *addr, int order) {
     if (!addr || !mm.initialized || order > MAX_ORDER || order < 0)
         return;
         
-    buddy_free(&mm.buddy, addr, order);
+    page_t *page = virt_to_page(addr);
+    buddy_free(pfn_zone(page_to_pfn(page)), addr, order);
 }
 
-// ================= Virtual Memory =================
-
-// Вспомогательная функция для проверки пустых таблиц
-static bool is_table_empty(uint64_t *table) {
-    for (int i = 0; i < 512; i++) {
-        if (table[i] & PAGE_PRESENT) {
-            return false;
-        }
+// Делит блок order на независимые страницы, каждую можно освободить с order 0
+void split_page(void *addr, int order) {
+    page_t *page = virt_to_page(addr);
+    
+    for (unsigned long i = 0; i < (1UL << order); i++) {
+        page[i].order = 0;
+        page[i].refcount = 1;
     }
-    return true;
 }
 
-int map_pages(uintptr_t virt, uintptr_t phys, size_t count, uint64_t flags) {
-    if (!mm.initialized)
-        return -1;
-    
-    uint64_t *pml4 = (uint64_t *)phys_to_virt(PML4_BASE);
-    
-    for (size_t i = 0; i < count; i++) {
-        uint64_t *pdp, *pd, *pt;
-        uintptr_t cur_virt = virt + i * PAGE_SIZE;
-        uintptr_t cur_phys = phys + i * PAGE_SIZE;
-
-        // PML4
-        uint64_t pml4e = pml4[PML4_INDEX(cur_virt)];
-        if (!(pml4e & PAGE_PRESENT)) {
-            void *pdp_phys = page_alloc(0);
-            if (!pdp_phys) {
-                // Откатываем все предыдущие маппинги
-                unmap_pages(virt, i);
-                return -1;
-            }
-            pdp = (uint64_t *)phys_to_virt((uintptr_t)pdp_phys);
-            memset(pdp, 0, PAGE_SIZE);
-            pml4[PML4_INDEX(cur_virt)] = (uintptr_t)pdp_phys | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
-        } else {
-            pdp = (uint64_t *)phys_to_virt(pml4e & PAGE_MASK);
-        }
-
-        // PDP
-        uint64_t pdpe = pdp[PDP_INDEX(cur_virt)];
-        if (!(pdpe & PAGE_PRESENT)) {
-            void *pd_phys = page_alloc(0);
-            if (!pd_phys) {
-                unmap_pages(virt, i);
-                return -1;
-            }
-            pd = (uint64_t *)phys_to_virt((uintptr_t)pd_phys);
-            memset(pd, 0, PAGE_SIZE);
-            pdp[PDP_INDEX(cur_virt)] = (uintptr_t)pd_phys | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
-        } else {
-            pd = (uint64_t *)phys_to_virt(pdpe & PAGE_MASK);
-        }
-
-        // PD
-        uint64_t pde = pd[PD_INDEX(cur_virt)];
-        if (!(pde & PAGE_PRESENT)) {
-            void *pt_phys = page_alloc(0);
-            if (!pt_phys) {
-                unmap_pages(virt, i);
-                return -1;
-            }
-            pt = (uint64_t *)phys_to_virt((uintptr_t)pt_phys);
-            memset(pt, 0, PAGE_SIZE);
-            pd[PD_INDEX(cur_virt)] = (uintptr_t)pt_phys | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
-        } else {
-            pt = (uint64_t *)phys_to_virt(pde & PAGE_MASK);
-        }
-
-        // PT
-        pt[PT_INDEX(cur_virt)] = cur_phys | flags;
-        asm volatile("invlpg (%0)" : : "r" (cur_virt) : "memory");
-    }
-    
-    return 0;
+void get_page(void *addr) {
+    virt_to_page(addr)->refcount++;
 }
 
-void unmap_pages(uintptr_t virt, size_t count) {
-    if (!mm.initialized)
+// Последняя ссылка возвращает страницу в buddy
+void put_page(void *addr) {
+    page_t *page = virt_to_page(addr);
+    if (page->refcount > 1) {
+        page->refcount--;
         return;
-        
-    uint64_t *pml4 = (uint64_t *)phys_to_virt(PML4_BASE);
-    
-    for (size_t i = 0; i < count; i++) {
-        uintptr_t cur_virt = virt + i * PAGE_SIZE;
-        
-        uint64_t pml4e = pml4[PML4_INDEX(cur_virt)];
-        if (!(pml4e & PAGE_PRESENT))
-            continue;
-            
-        uint64_t *pdp = (uint64_t *)phys_to_virt(pml4e & PAGE_MASK);
-        uint64_t pdpe = pdp[PDP_INDEX(cur_virt)];
-        if (!(pdpe & PAGE_PRESENT))
-            continue;
-            
-        uint64_t *pd = (uint64_t *)phys_to_virt(pdpe & PAGE_MASK);
-        uint64_t pde = pd[PD_INDEX(cur_virt)];
-        if (!(pde & PAGE_PRESENT))
-            continue;
-            
-        uint64_t *pt = (uint64_t *)phys_to_virt(pde & PAGE_MASK);
-        pt[PT_INDEX(cur_virt)] = 0;
-        
-        // Проверяем и освобождаем пустые таблицы
-        if (is_table_empty(pt)) {
-            page_free((void *)(pde & PAGE_MASK), 0);
-            pd[PD_INDEX(cur_virt)] = 0;
-        }
-        
-        if (is_table_empty(pd)) {
-            page_free((void *)(pdpe & PAGE_MASK), 0);
-            pdp[PDP_INDEX(cur_virt)] = 0;
-        }
-        
-        if (is_table_empty(pdp)) {
-            page_free((void *)(pml4e & PAGE_MASK), 0);
-            pml4[PML4_INDEX(cur_virt)] = 0;
-        }
-        
-        asm volatile("invlpg (%0)" : : "r" (cur_virt) : "memory");
-    }
-}
-
-uintptr_t virt_to_phys(uintptr_t virt) {
-    if (!mm.initialized)
-        return 0;
-        
-    uint64_t *pml4 = (uint64_t *)phys_to_virt(PML4_BASE);
-    uint64_t pml4e = pml4[PML4_INDEX(virt)];
-    if (!(pml4e & PAGE_PRESENT))
-        return 0;
-        
-    uint64_t *pdp = (uint64_t *)phys_to_virt(pml4e & PAGE_MASK);
-    uint64_t pdpe = pdp[PDP_INDEX(virt)];
-    
-    // Проверка на 1GB страницы
-    if (pdpe & PAGE_HUGE) {
-        return (pdpe & ~0x3FFFFF) | (virt & 0x3FFFFF);
     }
     
-    if (!(pdpe & PAGE_PRESENT))
-        return 0;
-        
-    uint64_t *pd = (uint64_t *)phys_to_virt(pdpe & PAGE_MASK);
-    uint64_t pde = pd[PD_INDEX(virt)];
-    
-    // Проверка на 2MB страницы
-    if (pde & PAGE_HUGE) {
-        return (pde & ~0x1FFFFF) | (virt & 0x1FFFFF);
-    }
-    
-    if (!(pde & PAGE_PRESENT))
-        return 0;
-        
-    uint64_t *pt = (uint64_t *)phys_to_virt(pde & PAGE_MASK);
-    uint64_t pte = pt[PT_INDEX(virt)];
-    if (!(pte & PAGE_PRESENT))
-        return 0;
-        
-    return (pte & PAGE_MASK) | (virt & ~PAGE_MASK);
+    page_free(page_address(page), page->order);
 }
 
 uintptr_t phys_to_virt(uintptr_t phys) {
-    return phys;
+    return phys + mm.phys_offset;
 }
 
 size_t kmalloc_size(const void *ptr) {
     if (!ptr || !mm.initialized)
         return 0;
         
-    for (int i = 0; i < 8; i++) {
-        kmem_cache_t *cache = &mm.kmalloc_caches[i];
-        slab_t *slab;
+    page_t *page = virt_to_page(ptr);
+    if (page->flags & PG_slab)
+        return page->slab->cache->obj_size;
         
-        list_for_each_entry(slab, &cache->slabs_full, list) {
-            if ((uintptr_t)ptr >= (uintptr_t)(slab + 1) && 
-                (uintptr_t)ptr < (uintptr_t)(slab + 1) + (PAGE_SIZE << cache->order)) {
-                return cache->obj_size;
-            }
-        }
+    return PAGE_SIZE << page->order;
+}
+
+const char *mm_tag_name(int tag) {
+    if (tag < 0 || tag >= MM_NR_TAGS)
+        return "?";
+    return mm_tag_names[tag];
+}
+
+// Снимок собирается из счётчиков, которые ведутся при выделении и освобождении
+static void meminfo_add_cache(meminfo_t *info, const kmem_cache_t *cache) {
+    info->slab_pages += cache->pages;
+    if (info->nr_caches == MEMINFO_MAX_CACHES) {
+        info->caches_omitted++;
+        return;
+    }
+    
+    meminfo_cache_t *c = &info->caches[info->nr_caches++];
+    c->name = cache->name;
+    c->obj_size = cache->obj_size;
+    c->objects = cache->objects;
+    c->active = cache->active;
+    c->pages = cache->pages;
+    c->free_slabs = cache->free_slabs;
+}
+
+void mm_get_meminfo(meminfo_t *info) {
+    memset(info, 0, sizeof(*info));
+    if (!mm.initialized)
+        return;
         
-        list_for_each_entry(slab, &cache->slabs_partial, list) {
-            if ((uintptr_t)ptr >= (uintptr_t)(slab + 1) && 
-                (uintptr_t)ptr < (uintptr_t)(slab + 1) + (PAGE_SIZE << cache->order)) {
-                return cache->obj_size;
-            }
+    for (int z = 0; z < MAX_NR_ZONES; z++) {
+        buddy_t *zone = &mm.zones[z];
+        info->total_pages += zone->managed;
+        info->free_pages += zone->nr_free;
+        info->zone_free[z] = zone->nr_free;
+        for (int i = 0; i <= MAX_ORDER; i++) {
+            info->free_blocks[i] += zone->nr_blocks[i];
         }
     }
     
-    page_t *page = (page_t *)((uintptr_t)ptr & PAGE_MASK);
-    return PAGE_SIZE << page->order;
+    for (int i = 0; i < KMALLOC_NR_CACHES; i++) {
+        meminfo_add_cache(info, &mm.kmalloc_caches[i]);
+    }
+    
+    kmem_cache_t *cache;
+    list_for_each_entry(cache, &mm.caches, list) {
+        if (!is_kmalloc_cache(cache))
+            meminfo_add_cache(info, cache);
+    }
+    
+    info->zero_pool_pages = mm.zero_nr;
+    info->vmalloc_pages = vmalloc_nr_pages();
+    info->pagecache_pages = pagecache_nr_pages();
+    memcpy(info->tag_bytes, mm.tag_bytes, sizeof(info->tag_bytes));
 }
 
 void mm_dump_stats(void) {
@@ -561,32 +1242,54 @@ void mm_dump_stats(void) {
     
     printf("Memory Manager Statistics:\n");
     printf("  Buddy Allocator:\n");
-    printf("    Total free pages: %lu\n", mm.buddy.nr_free);
-    for (int i = 0; i <= MAX_ORDER; i++) {
-        int count = 0;
-        list_head_t *pos;
-        list_for_each(pos, &mm.buddy.free_area[i]) {
-            count++;
+    for (int z = 0; z < MAX_NR_ZONES; z++) {
+        buddy_t *zone = &mm.zones[z];
+        if (!zone->managed)
+            continue;
+            
+        printf("    Zone %s: %u of %u pages free\n", zone->name,
+              (unsigned int)zone->nr_free, (unsigned int)zone->managed);
+        for (int i = 0; i <= MAX_ORDER; i++) {
+            printf("      Order %d: %u blocks\n", i, (unsigned int)zone->nr_blocks[i]);
         }
-        printf("    Order %d: %d blocks\n", i, count);
     }
     
     printf("\n  Slab Allocators:\n");
-    for (int i = 0; i < 8; i++) {
+    for (int i = 0; i < KMALLOC_NR_CACHES; i++) {
         kmem_cache_t *cache = &mm.kmalloc_caches[i];
-        int full = 0, partial = 0, free = 0;
-        slab_t *slab;
-        
-        list_for_each_entry(slab, &cache->slabs_full, list)
-            full++;
-            
-        list_for_each_entry(slab, &cache->slabs_partial, list)
-            partial++;
-            
-        list_for_each_entry(slab, &cache->slabs_free, list)
-            free++;
-        
-        printf("    %s: objsize=%zu slabs(full=%d, partial=%d, free=%d)\n",
-              cache->name, cache->obj_size, full, partial, free);
+        printf("    %s: objsize=%u objects=%u/%u pages=%u free slabs=%u\n",
+              cache->name, (unsigned int)cache->obj_size, cache->active, cache->objects,
+              cache->pages, cache->free_slabs);
+    }
+    
+    printf("\n  Slab shrinker: %u pages reclaimed\n", (unsigned int)mm.shrink_reclaimed);
+    printf("  Zeroed page pool: %u pages, %lld hits, %lld misses\n", (unsigned int)mm.zero_nr,
+          (long long)mm.zero_hits, (long long)mm.zero_misses);
+    printf("  Compaction: %lld succeeded, %lld failed, %lld pages migrated\n",
+          (long long)mm.compact_success, (long long)mm.compact_fail, 
+          (long long)mm.compact_migrated);
+    printf("  Copy-on-write: %lld pages copied, %lld reused\n",
+          (long long)mm.cow_copied, (long long)mm.cow_reused);
+    printf("  Page faults: %lld demand (avg %lld cycles), %lld COW (avg %lld cycles), "
+           "%lld unhandled, max %lld cycles\n",
+          (long long)mm.fault_demand, 
+          (long long)(mm.fault_demand ? mm.fault_cycles_demand / mm.fault_demand : 0),
+          (long long)mm.fault_cow,
+          (long long)(mm.fault_cow ? mm.fault_cycles_cow / mm.fault_cow : 0),
+          (long long)mm.fault_unhandled, (long long)mm.fault_cycles_max);
+    vmalloc_dump_stats();
+    pagecache_dump_stats();
+    
+    printf("\n  kmalloc by tag:\n");
+    for (int i = 0; i < MM_NR_TAGS; i++) {
+        printf("    %s: %lld bytes\n", mm_tag_names[i], (long long)mm.tag_bytes[i]);
     }
-}
\ No newline at end of file
+    
+    printf("\n  kmalloc internal fragmentation:\n");
+    printf("    requested: %lld bytes, allocated: %lld bytes\n",
+          (long long)mm.kmalloc_requested, (long long)mm.kmalloc_allocated);
+    printf("    waste: %lld bytes (power-of-two classes: %lld bytes, saved %lld)\n",
+          (long long)(mm.kmalloc_allocated - mm.kmalloc_requested),
+          (long long)(mm.kmalloc_pow2 - mm.kmalloc_requested),
+          (long long)(mm.kmalloc_pow2 - mm.kmalloc_allocated));
+}
@@ -28,15 +28,58 @@
 #define PAGE_DIRTY      (1 << 6)
 #define PAGE_HUGE       (1 << 7)
 #define PAGE_GLOBAL     (1 << 8)
+#define PAGE_COW        (1UL << 9)     // программный бит: запись копирует страницу
+#define PAGE_NX         (1UL << 63)
+#define PAGE_ADDR_MASK  0x000FFFFFFFFFF000UL
+
+#define PAGE_OFFSET     0xFFFF888000000000UL
+#define HUGE_2M_SIZE    (1UL << 21)
+#define HUGE_1G_SIZE    (1UL << 30)
 
 #define MAX_ORDER       10
 #define BUDDY_MAX_SIZE  (PAGE_SIZE << MAX_ORDER)
 
+#define ZONE_DMA        0
+#define ZONE_DMA32      1
+#define ZONE_NORMAL     2
+#define MAX_NR_ZONES    3
+
+#define ZONE_DMA_LIMIT      (16UL << 20)
+#define ZONE_DMA32_LIMIT    (4UL << 30)
+
+#define MM_LOW_LIMIT        0x100000
+#define MM_FALLBACK_END     (32UL << 20)
+#define BOOT_MAP_LIMIT      (1UL << 30)
+#define MM_MAX_REGIONS      32
+
+#define GFP_KERNEL      0
+#define GFP_DMA         (1U << 0)
+#define GFP_DMA32       (1U << 1)
+#define GFP_ZERO        (1U << 2)
+
+#define MM_TAG_NONE     0
+#define MM_TAG_PROS     1
+#define MM_TAG_FAT      2
+#define MM_TAG_VBE      3
+#define MM_TAG_PCI      4
+#define MM_NR_TAGS      5
+
+#define ZERO_POOL_TARGET    64
+#define ZERO_POOL_BATCH     8
+
 #define SLAB_MIN_SIZE   16
-#define SLAB_MAX_SIZE   PAGE_SIZE
+#define SLAB_MAX_SIZE   (PAGE_SIZE << 3)
+#define SLAB_MAX_ORDER  5
+#define SLAB_OFF_SLAB_SIZE (PAGE_SIZE >> 3)
 
 #define KMALLOC_MIN_SIZE SLAB_MIN_SIZE
-#define KMALLOC_MAX_SIZE (PAGE_SIZE << 3)
+#define KMALLOC_MAX_SIZE SLAB_MAX_SIZE
+#define KMALLOC_NR_CACHES 23
+#define MEMINFO_MAX_CACHES (KMALLOC_NR_CACHES + 32)
+
+#define SLAB_FREE_LIMIT 2
+
+#define CACHE_LINE_SIZE 64
 
 #define ALIGN(x, a)     __ALIGN_MASK(x, (typeof(x))(a)-1)
 #define __ALIGN_MASK(x, mask) (((x) + (mask)) & ~(mask))
@@ -65,71 +108,209 @@ typedef struct list_head {
     struct list_head *next, *prev;
 } list_head_t;
 
+#define PG_reserved     (1UL << 0)
+#define PG_buddy        (1UL << 1)
+#define PG_slab         (1UL << 2)
+#define PG_pgtable      (1UL << 3)
+#define PG_movable      (1UL << 4)
+#define PG_dirty        (1UL << 5)     // страница кэша новее диска
+
+#define TLB_FLUSH_ALL_PAGES 32
+
+// Биты кода ошибки #PF
+#define PF_PRESENT      (1 << 0)
+#define PF_WRITE        (1 << 1)
+
+struct slab;
+struct movable_ops;
+
 typedef struct page {
     list_head_t list;
     unsigned int order;
     unsigned int refcount;
     unsigned long flags;
+    struct slab *slab;
+    unsigned int nr_ptes;       // занятые записи, если страница - таблица страниц
+    const struct movable_ops *mops;
+    void *owner;                // владелец PG_movable страницы и её номер у него
+    unsigned long index;        // у крупных объектов kmalloc - запрошенный размер
+    uint8_t tag;                // MM_TAG_* для страниц kmalloc
 } page_t;
 
+// Перенос содержимого в new_addr и обновление ссылок владельца;
+// поля mops/owner/index новой страницы уже заполнены
+typedef struct movable_ops {
+    bool (*migrate)(page_t *page, void *new_addr);
+    uintptr_t (*vaddr)(page_t *page);  // где владелец отображает страницу, для COW; может быть NULL
+} movable_ops_t;
+
 typedef struct {
+    const char *name;
     list_head_t free_area[MAX_ORDER+1];
+    unsigned long nr_blocks[MAX_ORDER+1];
     unsigned long nr_free;
-    uintptr_t base;
-    size_t size;
+    unsigned long managed;
+    unsigned long start_pfn;
+    unsigned long end_pfn;
 } buddy_t;
 
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} mm_region_t;
+
 typedef struct kmem_cache kmem_cache_t;
 
 typedef struct slab {
     list_head_t list;
+    void *s_mem;
     void *freelist;
     unsigned int inuse;
     unsigned int free;
     kmem_cache_t *cache;
+    uint16_t *sizes;            // запрошенные размеры объектов kmalloc, иначе NULL
+    uint8_t tags[];             // MM_TAG_* каждого объекта
 } slab_t;
 
 struct kmem_cache {
     char name[32];
+    list_head_t list;
     list_head_t slabs_full;
     list_head_t slabs_partial;
     list_head_t slabs_free;
     size_t obj_size;
+    size_t align;
+    size_t offset;
     unsigned int objs_per_slab;
     unsigned int order;
     unsigned int objects;
+    unsigned int active;
     unsigned int pages;
+    unsigned int free_slabs;
+    unsigned int free_limit;
+    unsigned int colour;
+    unsigned int colour_off;
+    unsigned int colour_next;
+    void (*ctor)(void *);
+    void (*dtor)(void *);
+    bool off_slab;
 };
 
 typedef struct {
-    buddy_t buddy;
-    kmem_cache_t kmalloc_caches[8];
+    buddy_t zones[MAX_NR_ZONES];
+    mm_region_t usable[MM_MAX_REGIONS];
+    mm_region_t reserved[MM_MAX_REGIONS];
+    int nr_usable;
+    int nr_reserved;
+    kmem_cache_t kmalloc_caches[KMALLOC_NR_CACHES];
+    uint64_t kmalloc_requested;
+    uint64_t kmalloc_allocated;
+    uint64_t kmalloc_pow2;
+    uint64_t tag_bytes[MM_NR_TAGS];
+    list_head_t caches;
+    unsigned long shrink_reclaimed;
+    list_head_t zero_pool;
+    unsigned long zero_nr;
+    uint64_t zero_hits;
+    uint64_t zero_misses;
+    uint64_t compact_success;
+    uint64_t compact_fail;
+    uint64_t compact_migrated;
+    uint64_t cow_copied;
+    uint64_t cow_reused;
+    uint64_t fault_demand;
+    uint64_t fault_cow;
+    uint64_t fault_unhandled;
+    uint64_t fault_cycles_demand;
+    uint64_t fault_cycles_cow;
+    uint64_t fault_cycles_max;
+    uint64_t direct_map_end;
+    bool direct_map_1g;
+    bool global_pages;
+    uint64_t kernel_pml4_gen;      // растёт, когда у ядра появляется новая запись PML4
+    page_t *mem_map;
+    unsigned long start_pfn;
+    unsigned long nr_pages;
     uintptr_t phys_offset;
     bool initialized;
 } mm_struct;
 
-void mm_init(uintptr_t mem_start, uintptr_t mem_end);
+typedef struct {
+    const char *name;
+    size_t obj_size;
+    unsigned int objects;
+    unsigned int active;
+    unsigned int pages;
+    unsigned int free_slabs;
+} meminfo_cache_t;
+
+typedef struct {
+    unsigned long total_pages;
+    unsigned long free_pages;
+    unsigned long free_blocks[MAX_ORDER+1];
+    unsigned long zone_free[MAX_NR_ZONES];
+    unsigned long slab_pages;
+    unsigned long zero_pool_pages;
+    unsigned long vmalloc_pages;
+    unsigned long pagecache_pages;
+    // Сначала классы kmalloc, затем кэши kmem_cache_create; сверх
+    // MEMINFO_MAX_CACHES кэши попадают только в slab_pages и caches_omitted
+    meminfo_cache_t caches[MEMINFO_MAX_CACHES];
+    unsigned int nr_caches;
+    unsigned int caches_omitted;
+    uint64_t tag_bytes[MM_NR_TAGS];
+} meminfo_t;
+
+void mm_init(uint32_t magic, void *mbi);
 
 void *kmalloc(size_t size);
+void *kmalloc_tag(size_t size, int tag);
 void *kcalloc(size_t n, size_t size);
 void *krealloc(void *p, size_t size);
 void kfree(const void *ptr);
 
+void *alloc_pages(unsigned int gfp, int order);
 void *page_alloc(int order);
 void page_free(void *addr, int order);
-
+void split_page(void *addr, int order);
+page_t *virt_to_page(const void *addr);
+void *page_address(const page_t *page);
+void set_page_movable(void *addr, const movable_ops_t *ops, void *owner, unsigned long index);
+void clear_page_movable(void *addr);
+void get_page(void *addr);
+void put_page(void *addr);
+void mm_idle(void);
+
+int map_range(uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags);
+void unmap_range(uintptr_t virt, size_t size);
+int map_range_in(uint64_t *pml4, uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags);
+void unmap_range_in(uint64_t *pml4, uintptr_t virt, size_t size);
+void flush_tlb_range(uintptr_t virt, uintptr_t end);
+void flush_tlb_all(void);
+uint64_t mm_kernel_pml4_gen(void);
+bool mm_global_pages(void);
 int map_pages(uintptr_t virt, uintptr_t phys, size_t count, uint64_t flags);
 void unmap_pages(uintptr_t virt, size_t count);
+int map_shared(uintptr_t virt, uintptr_t src, size_t size, uint64_t flags);
+void unmap_shared(uintptr_t virt, size_t size);
+bool pte_test_and_clear_dirty(uintptr_t virt);
+int mm_handle_page_fault(uintptr_t addr, uint64_t error);
 uintptr_t virt_to_phys(uintptr_t virt);
 uintptr_t phys_to_virt(uintptr_t phys);
 
-kmem_cache_t *kmem_cache_create(const char *name, size_t size);
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                void (*ctor)(void *), void (*dtor)(void *));
 void *kmem_cache_alloc(kmem_cache_t *cache);
 void kmem_cache_free(kmem_cache_t *cache, void *obj);
 void kmem_cache_destroy(kmem_cache_t *cache);
+unsigned long kmem_cache_shrink(kmem_cache_t *cache);
+void kmem_cache_set_free_limit(kmem_cache_t *cache, unsigned int limit);
+unsigned long kmem_shrink_all(void);
 
 size_t kmalloc_size(const void *ptr);
 void mm_dump_stats(void);
+void mm_get_meminfo(meminfo_t *info);
+const char *mm_tag_name(int tag);
 
 extern uint64_t pml4_table_phys;
 #define PML4_BASE (pml4_table_phys)
@@ -141,6 +322,9 @@ extern uint64_t pml4_table_phys;
 #define list_first_entry(ptr, type, member) \
     container_of((ptr)->next, type, member)
 
+#define list_last_entry(ptr, type, member) \
+    container_of((ptr)->prev, type, member)
+
 #define list_for_each_entry(pos, head, member) \
     for (pos = container_of((head)->next, typeof(*pos), member); \
          &pos->member != (head); \
@@ -172,4 +356,17 @@ static inline int list_empty(const list_head_t *head)
     return head->next == head;
 }
 
+static inline int get_order(size_t size)
+{
+    int order = 0;
+    if (size <= PAGE_SIZE)
+        return 0;
+    size = (size - 1) >> PAGE_SHIFT;
+    while (size) {
+        order++;
+        size >>= 1;
+    }
+    return order;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include "pagecache.h"
+#include "string.h"
+#include "stdio.h"
+
+static struct {
+    list_head_t hash[PAGECACHE_HASH_SIZE];
+    bool initialized;
+    size_t nr_pages;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t written;
+} pcache;
+
+// Страницы кэша связаны через page->list, owner и index - ключ поиска
+static inline list_head_t *pagecache_bucket(address_space_t *mapping, unsigned long index) {
+    uint64_t key = ((uintptr_t)mapping >> 4) ^ index;
+    return &pcache.hash[(key * 0x9E3779B97F4A7C15UL) >> (64 - PAGECACHE_HASH_BITS)];
+}
+
+static void pagecache_init(void) {
+    for (int i = 0; i < PAGECACHE_HASH_SIZE; i++) {
+        INIT_LIST_HEAD(&pcache.hash[i]);
+    }
+    pcache.initialized = true;
+}
+
+// Пока на страницу ссылается только кэш, её можно перенести
+static bool pagecache_migrate(page_t *page, void *new_addr) {
+    page_t *new_page = virt_to_page(new_addr);
+    
+    memcpy(new_addr, page_address(page), PAGE_SIZE);
+    list_add(&new_page->list, &page->list);
+    list_del(&page->list);
+    
+    new_page->flags |= page->flags & PG_dirty;
+    page->flags &= ~PG_dirty;
+    return true;
+}
+
+static const movable_ops_t pagecache_mops = {
+    .migrate = pagecache_migrate,
+};
+
+static void pagecache_remove(page_t *page) {
+    address_space_t *mapping = (address_space_t *)page->owner;
+    
+    list_del(&page->list);
+    page->flags &= ~PG_dirty;
+    mapping->nr_pages--;
+    pcache.nr_pages--;
+    
+    void *addr = page_address(page);
+    clear_page_movable(addr);
+    put_page(addr);
+}
+
+void *pagecache_lookup(address_space_t *mapping, unsigned long index) {
+    if (!pcache.initialized)
+        return NULL;
+        
+    page_t *page;
+    list_head_t *bucket = pagecache_bucket(mapping, index);
+    list_for_each_entry(page, bucket, list) {
+        if (page->owner == mapping && page->index == index)
+            return page_address(page);
+    }
+    
+    return NULL;
+}
+
+// Возвращает страницу с дополнительной ссылкой, её снимает put_page
+void *pagecache_get(address_space_t *mapping, unsigned long index) {
+    if (!pcache.initialized)
+        pagecache_init();
+        
+    void *addr = pagecache_lookup(mapping, index);
+    if (addr) {
+        pcache.hits++;
+        get_page(addr);
+        return addr;
+    }
+    
+    addr = alloc_pages(GFP_KERNEL, 0);
+    if (!addr)
+        return NULL;
+        
+    if (mapping->ops->readpage(mapping, index, addr) != 0) {
+        page_free(addr, 0);
+        return NULL;
+    }
+    
+    list_add(&virt_to_page(addr)->list, pagecache_bucket(mapping, index));
+    set_page_movable(addr, &pagecache_mops, mapping, index);
+    mapping->nr_pages++;
+    pcache.nr_pages++;
+    pcache.misses++;
+    
+    get_page(addr);
+    return addr;
+}
+
+void pagecache_set_dirty(void *addr) {
+    virt_to_page(addr)->flags |= PG_dirty;
+}
+
+int pagecache_writeback(address_space_t *mapping) {
+    if (!pcache.initialized)
+        return 0;
+        
+    int ret = 0;
+    for (int i = 0; i < PAGECACHE_HASH_SIZE; i++) {
+        page_t *page;
+        list_for_each_entry(page, &pcache.hash[i], list) {
+            if (page->owner != mapping || !(page->flags & PG_dirty))
+                continue;
+                
+            if (mapping->ops->writepage(mapping, page->index, page_address(page)) != 0) {
+                ret = -1;
+                continue;
+            }
+            
+            page->flags &= ~PG_dirty;
+            pcache.written++;
+        }
+    }
+    
+    return ret;
+}
+
+// Отображённые страницы остаются у тех, кто их держит; грязные теряются
+unsigned long pagecache_invalidate(address_space_t *mapping) {
+    if (!pcache.initialized)
+        return 0;
+        
+    unsigned long dropped = 0;
+    for (int i = 0; i < PAGECACHE_HASH_SIZE; i++) {
+        page_t *page, *n;
+        list_for_each_entry_safe(page, n, &pcache.hash[i], list) {
+            if (page->owner != mapping)
+                continue;
+                
+            if (page->refcount > 1) {
+                // Больше не находится поиском и освободится с последней ссылкой
+                list_del(&page->list);
+                INIT_LIST_HEAD(&page->list);
+                page->flags &= ~PG_dirty;
+                clear_page_movable(page_address(page));
+                mapping->nr_pages--;
+                pcache.nr_pages--;
+                continue;
+            }
+            
+            pagecache_remove(page);
+            dropped++;
+        }
+    }
+    
+    return dropped;
+}
+
+// Чистые неотображённые страницы всегда можно перечитать с диска
+unsigned long pagecache_shrink(void) {
+    if (!pcache.initialized)
+        return 0;
+        
+    unsigned long freed = 0;
+    for (int i = 0; i < PAGECACHE_HASH_SIZE; i++) {
+        page_t *page, *n;
+        list_for_each_entry_safe(page, n, &pcache.hash[i], list) {
+            if (page->refcount == 1 && !(page->flags & PG_dirty)) {
+                pagecache_remove(page);
+                freed++;
+            }
+        }
+    }
+    
+    return freed;
+}
+
+size_t pagecache_nr_pages(void) {
+    return pcache.nr_pages;
+}
+
+void pagecache_dump_stats(void) {
+    printf("  Page cache: %u pages, %lld hits, %lld misses, %lld pages written back\n",
+          (unsigned int)pcache.nr_pages, (long long)pcache.hits, (long long)pcache.misses,
+          (long long)pcache.written);
+}
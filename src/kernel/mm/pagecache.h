@@ -0,0 +1,32 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include "mem.h"
+
+#define PAGECACHE_HASH_BITS 8
+#define PAGECACHE_HASH_SIZE (1 << PAGECACHE_HASH_BITS)
+
+struct address_space;
+
+typedef struct address_space_ops {
+    int (*readpage)(struct address_space *mapping, unsigned long index, void *page);
+    int (*writepage)(struct address_space *mapping, unsigned long index, const void *page);
+} address_space_ops_t;
+
+// Закэшированный объект (файл); страницы ищутся по (mapping, index)
+typedef struct address_space {
+    const address_space_ops_t *ops;
+    void *host;
+    unsigned long nr_pages;
+} address_space_t;
+
+void *pagecache_get(address_space_t *mapping, unsigned long index);
+void *pagecache_lookup(address_space_t *mapping, unsigned long index);
+void pagecache_set_dirty(void *page);
+int pagecache_writeback(address_space_t *mapping);
+unsigned long pagecache_invalidate(address_space_t *mapping);
+unsigned long pagecache_shrink(void);
+size_t pagecache_nr_pages(void);
+void pagecache_dump_stats(void);
+
+#endif
@@ -0,0 +1,562 @@
+#include "internal.h"
+#include "vmalloc.h"
+#include "aspace.h"
+#include "string.h"
+#include "stdio.h"
+#include <asm/io.h>
+
+extern char kernel_start[], kernel_end[];
+
+// ================= Boot Page Tables =================
+
+static bool cpu_has_pdpe1gb(void) {
+    uint32_t eax, ebx, ecx, edx;
+    
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000));
+    if (eax < 0x80000001)
+        return false;
+        
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001), "c"(0));
+    return edx & (1U << 26);
+}
+
+static bool cpu_has_pge(void) {
+    uint32_t eax, ebx, ecx, edx;
+    
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    return edx & (1U << 13);
+}
+
+// Образ ядра и прямое отображение одинаковы во всех адресных пространствах,
+// глобальные записи TLB переживают перезагрузку CR3
+static void mm_enable_global_pages(void) {
+    if (!cpu_has_pge())
+        return;
+        
+    uint64_t *pml4 = (uint64_t *)PML4_BASE;
+    uint64_t *pdp = (uint64_t *)(pml4[0] & PAGE_ADDR_MASK);
+    uint64_t *pd = (uint64_t *)(pdp[0] & PAGE_ADDR_MASK);
+    
+    for (uintptr_t addr = ALIGN_DOWN((uintptr_t)kernel_start, HUGE_2M_SIZE); 
+         addr < (uintptr_t)kernel_end; addr += HUGE_2M_SIZE) {
+        pd[PD_INDEX(addr)] |= PAGE_GLOBAL;
+    }
+    
+    // Включение CR4.PGE само сбрасывает TLB
+    asm volatile("mov %%cr4, %%rax; or $0x80, %%rax; mov %%rax, %%cr4" : : : "rax", "memory");
+    mm.global_pages = true;
+}
+
+// Прямое отображение [0, max_addr) на PAGE_OFFSET страницами 1 ГБ или 2 МБ.
+// Таблицы пишутся через загрузочное identity-отображение, поэтому лежат ниже BOOT_MAP_LIMIT
+static bool mm_build_direct_map(uint64_t max_addr) {
+    bool huge_1g = cpu_has_pdpe1gb();
+    uint64_t size = ALIGN_UP(max_addr, huge_1g ? HUGE_1G_SIZE : HUGE_2M_SIZE);
+    
+    size_t nr_pdp = (size + (512 * HUGE_1G_SIZE) - 1) / (512 * HUGE_1G_SIZE);
+    size_t nr_pd = huge_1g ? 0 : (size + HUGE_1G_SIZE - 1) / HUGE_1G_SIZE;
+    size_t tables_size = (nr_pdp + nr_pd) * PAGE_SIZE;
+    
+    uint64_t tables = mm_early_alloc(tables_size, BOOT_MAP_LIMIT);
+    if (!tables)
+        return false;
+    memset((void *)tables, 0, tables_size);
+    
+    uint64_t *pml4 = (uint64_t *)PML4_BASE;
+    uint64_t *pdp = (uint64_t *)tables;
+    uint64_t *pd = pdp + nr_pdp * 512;
+    
+    for (size_t i = 0; i < nr_pdp; i++) {
+        pml4[PML4_INDEX(PAGE_OFFSET) + i] = (tables + i * PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITABLE;
+    }
+    
+    uint64_t leaf = PAGE_PRESENT | PAGE_WRITABLE | PAGE_HUGE | (mm.global_pages ? PAGE_GLOBAL : 0);
+    for (uint64_t addr = 0; addr < size; addr += HUGE_1G_SIZE) {
+        size_t gb = addr / HUGE_1G_SIZE;
+        
+        if (huge_1g) {
+            pdp[gb] = addr | leaf;
+            continue;
+        }
+        
+        uint64_t *table = pd + gb * 512;
+        pdp[gb] = (uintptr_t)table | PAGE_PRESENT | PAGE_WRITABLE;
+        for (int j = 0; j < 512 && addr + j * HUGE_2M_SIZE < size; j++) {
+            table[j] = (addr + j * HUGE_2M_SIZE) | leaf;
+        }
+    }
+    
+    asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" : : : "rax", "memory");
+    
+    mm.direct_map_end = size;
+    mm.direct_map_1g = huge_1g;
+    mm.phys_offset = PAGE_OFFSET;
+    return true;
+}
+
+bool paging_init_direct_map(uint64_t max_addr) {
+    mm_enable_global_pages();
+    return mm_build_direct_map(max_addr);
+}
+
+// Вызывается, когда buddy уже работает
+void paging_init(void) {
+    // Без CR0.WP ядро пишет в read-only страницы и COW не срабатывает
+    asm volatile("mov %%cr0, %%rax; or $0x10000, %%rax; mov %%rax, %%cr0" : : : "rax", "memory");
+    aspace_init();
+}
+
+// ================= Virtual Memory =================
+
+static const int pt_shift[4] = { PT_SHIFT, PD_SHIFT, PDP_SHIFT, PML4_SHIFT };
+
+// Счётчик ведётся только для таблиц, выделенных map_range;
+// загрузочные таблицы и таблицы прямого отображения не освобождаются
+static inline page_t *pt_page(uint64_t *table) {
+    page_t *page = phys_to_page(virt_to_phys((uintptr_t)table));
+    return (page && (page->flags & PG_pgtable)) ? page : NULL;
+}
+
+static inline void pt_count(uint64_t *table, int delta) {
+    page_t *page = pt_page(table);
+    if (page)
+        page->nr_ptes += delta;
+}
+
+static uint64_t *pt_alloc(void) {
+    uint64_t *table = (uint64_t *)alloc_pages(GFP_ZERO, 0);
+    if (!table)
+        return NULL;
+        
+    page_t *page = virt_to_page(table);
+    page->flags |= PG_pgtable;
+    page->nr_ptes = 0;
+    return table;
+}
+
+static void pt_free(uint64_t *table) {
+    virt_to_page(table)->flags &= ~PG_pgtable;
+    page_free(table, 0);
+}
+
+// Перезагрузка CR3 не трогает глобальные записи и другие PCID,
+// переключение CR4.PGE сбрасывает всё
+void flush_tlb_all(void) {
+    if (mm.global_pages) {
+        asm volatile("mov %%cr4, %%rax; xor $0x80, %%rax; mov %%rax, %%cr4; "
+                     "xor $0x80, %%rax; mov %%rax, %%cr4" : : : "rax", "memory");
+        return;
+    }
+    
+    asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" : : : "rax", "memory");
+}
+
+void flush_tlb_range(uintptr_t virt, uintptr_t end) {
+    if ((end - virt) >> PAGE_SHIFT > TLB_FLUSH_ALL_PAGES) {
+        flush_tlb_all();
+        return;
+    }
+    
+    for (; virt < end; virt += PAGE_SIZE) {
+        asm volatile("invlpg (%0)" : : "r" (virt) : "memory");
+    }
+}
+
+// Заменяет большую страницу уровня level таблицей с теми же отображениями
+static uint64_t *pt_split(uint64_t *table, int level, int index) {
+    uint64_t entry = table[index];
+    uint64_t *child = pt_alloc();
+    if (!child)
+        return NULL;
+        
+    uintptr_t step = 1UL << pt_shift[level - 1];
+    uintptr_t phys = entry & PAGE_ADDR_MASK & ~((1UL << pt_shift[level]) - 1);
+    uint64_t flags = entry & ~PAGE_ADDR_MASK;
+    if (level == 1)
+        flags &= ~PAGE_HUGE;
+        
+    for (int i = 0; i < 512; i++)
+        child[i] = (phys + i * step) | flags;
+    pt_page(child)->nr_ptes = 512;
+    
+    table[index] = virt_to_phys((uintptr_t)child) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+    return child;
+}
+
+// Один проход по каждой таблице уровня level для [virt, end).
+// При ошибке *failed - адрес, до которого отображение уже установлено
+static int map_level(uint64_t *table, int level, uintptr_t virt, uintptr_t end, 
+                     uintptr_t phys, uint64_t flags, uintptr_t *failed) {
+    uintptr_t span = 1UL << pt_shift[level];
+    
+    while (virt < end) {
+        uintptr_t next = (virt + span) & ~(span - 1);
+        if (next > end || next < virt)
+            next = end;
+            
+        int index = (virt >> pt_shift[level]) & 0x1FF;
+        uint64_t entry = table[index];
+        
+        if (level == 0) {
+            if (!(entry & PAGE_PRESENT))
+                pt_count(table, 1);
+            table[index] = phys | flags;
+        } else if (level == 1 && next - virt == span && !(phys & (span - 1)) &&
+                   (!(entry & PAGE_PRESENT) || (entry & PAGE_HUGE))) {
+            // Виртуальный и физический адреса выровнены на 2 МБ - хватит одной PDE
+            if (!(entry & PAGE_PRESENT))
+                pt_count(table, 1);
+            table[index] = phys | flags | PAGE_HUGE;
+        } else {
+            uint64_t *child;
+            bool fresh = false;
+            
+            if (!(entry & PAGE_PRESENT)) {
+                child = pt_alloc();
+                if (!child) {
+                    *failed = virt;
+                    return -1;
+                }
+                if (level == 3 && table == (uint64_t *)phys_to_virt(PML4_BASE))
+                    mm.kernel_pml4_gen++;
+                table[index] = virt_to_phys((uintptr_t)child) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+                pt_count(table, 1);
+                fresh = true;
+            } else if (entry & PAGE_HUGE) {
+                child = pt_split(table, level, index);
+                if (!child) {
+                    *failed = virt;
+                    return -1;
+                }
+            } else {
+                child = (uint64_t *)phys_to_virt(entry & PAGE_ADDR_MASK);
+            }
+            
+            if (map_level(child, level - 1, virt, next, phys, flags, failed) != 0) {
+                // Пустую таблицу, созданную здесь же, откат уже не найдёт
+                if (fresh && pt_page(child)->nr_ptes == 0) {
+                    table[index] = 0;
+                    pt_count(table, -1);
+                    pt_free(child);
+                }
+                return -1;
+            }
+        }
+        
+        phys += next - virt;
+        virt = next;
+    }
+    
+    return 0;
+}
+
+static void unmap_level(uint64_t *table, int level, uintptr_t virt, uintptr_t end) {
+    uintptr_t span = 1UL << pt_shift[level];
+    
+    while (virt < end) {
+        uintptr_t next = (virt + span) & ~(span - 1);
+        if (next > end || next < virt)
+            next = end;
+            
+        int index = (virt >> pt_shift[level]) & 0x1FF;
+        uint64_t entry = table[index];
+        
+        if (!(entry & PAGE_PRESENT)) {
+            virt = next;
+            continue;
+        }
+        
+        if (level == 0 || ((entry & PAGE_HUGE) && next - virt == span)) {
+            table[index] = 0;
+            pt_count(table, -1);
+        } else {
+            // Часть большой страницы: сначала дробим её. Без памяти под
+            // таблицу отображение остаётся - снять его частично нельзя
+            uint64_t *child = (entry & PAGE_HUGE) ? pt_split(table, level, index) :
+                              (uint64_t *)phys_to_virt(entry & PAGE_ADDR_MASK);
+            if (!child) {
+                virt = next;
+                continue;
+            }
+            
+            unmap_level(child, level - 1, virt, next);
+            
+            page_t *page = pt_page(child);
+            if (page && page->nr_ptes == 0) {
+                table[index] = 0;
+                pt_count(table, -1);
+                pt_free(child);
+            }
+        }
+        
+        virt = next;
+    }
+}
+
+// Без сброса TLB: pml4 может принадлежать неактивному адресному пространству
+int map_range_in(uint64_t *pml4, uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags) {
+    if (!mm.initialized || ((virt | phys) & ~PAGE_MASK))
+        return -1;
+        
+    size = ALIGN_UP(size, PAGE_SIZE);
+    if (!size)
+        return 0;
+        
+    uintptr_t failed = virt;
+    if (map_level(pml4, 3, virt, virt + size, phys, flags, &failed) != 0) {
+        // Откатываем только то, что успели отобразить
+        if (failed > virt)
+            unmap_level(pml4, 3, virt, failed);
+        return -1;
+    }
+    
+    return 0;
+}
+
+void unmap_range_in(uint64_t *pml4, uintptr_t virt, size_t size) {
+    if (!mm.initialized || (virt & ~PAGE_MASK))
+        return;
+        
+    size = ALIGN_UP(size, PAGE_SIZE);
+    if (size)
+        unmap_level(pml4, 3, virt, virt + size);
+}
+
+// Отображения ядра общие для всех адресных пространств, поэтому глобальные
+int map_range(uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags) {
+    if (mm.global_pages && !(flags & PAGE_USER))
+        flags |= PAGE_GLOBAL;
+        
+    int ret = map_range_in((uint64_t *)phys_to_virt(PML4_BASE), virt, phys, size, flags);
+    if (mm.initialized && !((virt | phys) & ~PAGE_MASK))
+        flush_tlb_range(virt, virt + ALIGN_UP(size, PAGE_SIZE));
+    return ret;
+}
+
+void unmap_range(uintptr_t virt, size_t size) {
+    if (!mm.initialized || (virt & ~PAGE_MASK))
+        return;
+        
+    unmap_range_in((uint64_t *)phys_to_virt(PML4_BASE), virt, size);
+    flush_tlb_range(virt, virt + ALIGN_UP(size, PAGE_SIZE));
+}
+
+uint64_t mm_kernel_pml4_gen(void) {
+    return mm.kernel_pml4_gen;
+}
+
+bool mm_global_pages(void) {
+    return mm.global_pages;
+}
+
+int map_pages(uintptr_t virt, uintptr_t phys, size_t count, uint64_t flags) {
+    return map_range(virt, phys, count * PAGE_SIZE, flags);
+}
+
+void unmap_pages(uintptr_t virt, size_t count) {
+    unmap_range(virt, count * PAGE_SIZE);
+}
+
+// PTE страницы 4 КБ; NULL, если адрес не отображён или лежит в большой странице
+static uint64_t *pte_lookup(uintptr_t virt) {
+    uint64_t *table = (uint64_t *)phys_to_virt(PML4_BASE);
+    
+    for (int level = 3; level > 0; level--) {
+        uint64_t entry = table[(virt >> pt_shift[level]) & 0x1FF];
+        if (!(entry & PAGE_PRESENT) || (entry & PAGE_HUGE))
+            return NULL;
+        table = (uint64_t *)phys_to_virt(entry & PAGE_ADDR_MASK);
+    }
+    
+    uint64_t *pte = &table[PT_INDEX(virt)];
+    return (*pte & PAGE_PRESENT) ? pte : NULL;
+}
+
+// Отображает в virt те же кадры, что видны по src, и берёт на них ссылки.
+// С PAGE_COW обе стороны становятся read-only и копируются при первой записи;
+// для этого src должен быть отображён страницами 4 КБ (vmalloc, map_range).
+// Кадры вне mem_map (видеопамять и т.п.) разделяются без счётчика ссылок
+int map_shared(uintptr_t virt, uintptr_t src, size_t size, uint64_t flags) {
+    if (!mm.initialized || ((virt | src) & ~PAGE_MASK))
+        return -1;
+        
+    size = ALIGN_UP(size, PAGE_SIZE);
+    bool cow = flags & PAGE_COW;
+    if (cow)
+        flags &= ~PAGE_WRITABLE;
+        
+    // Сначала проверяем весь диапазон, чтобы не откатывать половину
+    for (size_t off = 0; off < size; off += PAGE_SIZE) {
+        uintptr_t phys = virt_to_phys(src + off);
+        if (!phys)
+            return -1;
+            
+        // Хвост неразделённого блока или slab не имеет своего счётчика
+        page_t *page = phys_to_page(phys);
+        if (page && (page->refcount == 0 || (page->flags & PG_slab)))
+            return -1;
+        if (cow && (!page || !pte_lookup(src + off)))
+            return -1;
+    }
+    
+    for (size_t off = 0; off < size; off += PAGE_SIZE) {
+        uintptr_t phys = virt_to_phys(src + off);
+        
+        if (map_range(virt + off, phys, PAGE_SIZE, flags) != 0) {
+            unmap_shared(virt, off);
+            return -1;
+        }
+        
+        page_t *page = phys_to_page(phys);
+        if (page)
+            page->refcount++;
+            
+        if (cow) {
+            uint64_t *pte = pte_lookup(src + off);
+            *pte = (*pte & ~(uint64_t)PAGE_WRITABLE) | PAGE_COW;
+        }
+    }
+    
+    if (cow)
+        flush_tlb_range(src, src + size);
+    return 0;
+}
+
+void unmap_shared(uintptr_t virt, size_t size) {
+    if (!mm.initialized || (virt & ~PAGE_MASK))
+        return;
+        
+    size = ALIGN_UP(size, PAGE_SIZE);
+    
+    for (size_t off = 0; off < size; off += PAGE_SIZE) {
+        uint64_t *pte = pte_lookup(virt + off);
+        if (!pte)
+            continue;
+            
+        page_t *page = phys_to_page(*pte & PAGE_ADDR_MASK);
+        unmap_range(virt + off, PAGE_SIZE);
+        if (page)
+            put_page(page_address(page));
+    }
+}
+
+// Сбрасывает бит Dirty, который процессор ставит при записи через этот PTE
+bool pte_test_and_clear_dirty(uintptr_t virt) {
+    uint64_t *pte = mm.initialized ? pte_lookup(virt & PAGE_MASK) : NULL;
+    if (!pte || !(*pte & PAGE_DIRTY))
+        return false;
+        
+    *pte &= ~(uint64_t)PAGE_DIRTY;
+    asm volatile("invlpg (%0)" : : "r" (virt & PAGE_MASK) : "memory");
+    return true;
+}
+
+// Запись в COW-страницу: последний владелец просто получает право записи,
+// иначе пишущая сторона уходит на свою копию
+static int cow_fault(uintptr_t addr, uint64_t error) {
+    if (!(error & PF_WRITE))
+        return -1;
+        
+    uintptr_t virt = addr & PAGE_MASK;
+    uint64_t *pte = pte_lookup(virt);
+    if (!pte || !(*pte & PAGE_COW))
+        return -1;
+        
+    uint64_t phys = *pte & PAGE_ADDR_MASK;
+    uint64_t flags = (*pte & ~PAGE_ADDR_MASK & ~PAGE_COW) | PAGE_WRITABLE;
+    page_t *page = phys_to_page(phys);
+    if (!page)
+        return -1;
+        
+    if (page->refcount == 1) {
+        *pte = phys | flags;
+        asm volatile("invlpg (%0)" : : "r" (virt) : "memory");
+        mm.cow_reused++;
+        return 0;
+    }
+    
+    void *copy = alloc_pages(GFP_KERNEL, 0);
+    if (!copy)
+        return -1;
+        
+    // Свою страницу владелец переносит сам, чтобы обновить ссылки на неё
+    if (page->mops && page->mops->vaddr && page->mops->vaddr(page) == virt) {
+        if (!migrate_page(page, copy)) {
+            page_free(copy, 0);
+            return -1;
+        }
+    } else {
+        memcpy(copy, (void *)phys_to_virt(phys), PAGE_SIZE);
+        *pte = virt_to_phys((uintptr_t)copy) | flags;
+        asm volatile("invlpg (%0)" : : "r" (virt) : "memory");
+    }
+    
+    put_page(page_address(page));
+    mm.cow_copied++;
+    return 0;
+}
+
+// Отсутствующая страница - ленивые области vmalloc, иначе - COW
+int mm_handle_page_fault(uintptr_t addr, uint64_t error) {
+    if (!mm.initialized)
+        return -1;
+        
+    uint64_t start = rdtsc();
+    bool demand = !(error & PF_PRESENT);
+    
+    if ((demand ? vmalloc_fault(addr, error) : cow_fault(addr, error)) != 0) {
+        mm.fault_unhandled++;
+        return -1;
+    }
+    
+    uint64_t cycles = rdtsc() - start;
+    if (demand) {
+        mm.fault_demand++;
+        mm.fault_cycles_demand += cycles;
+    } else {
+        mm.fault_cow++;
+        mm.fault_cycles_cow += cycles;
+    }
+    if (cycles > mm.fault_cycles_max)
+        mm.fault_cycles_max = cycles;
+    return 0;
+}
+
+uintptr_t virt_to_phys(uintptr_t virt) {
+    // Прямое отображение - без обхода таблиц. Образ ядра и загрузочное
+    // identity-отображение проходят обход: там же может оказаться vmalloc
+    if (virt >= PAGE_OFFSET && virt - PAGE_OFFSET < mm.direct_map_end)
+        return virt - PAGE_OFFSET;
+        
+    uint64_t *pml4 = (uint64_t *)phys_to_virt(PML4_BASE);
+    uint64_t pml4e = pml4[PML4_INDEX(virt)];
+    if (!(pml4e & PAGE_PRESENT))
+        return 0;
+        
+    uint64_t *pdp = (uint64_t *)phys_to_virt(pml4e & PAGE_ADDR_MASK);
+    uint64_t pdpe = pdp[PDP_INDEX(virt)];
+    if (!(pdpe & PAGE_PRESENT))
+        return 0;
+    
+    // Проверка на 1GB страницы
+    if (pdpe & PAGE_HUGE) {
+        return (pdpe & PAGE_ADDR_MASK & ~(HUGE_1G_SIZE - 1)) | (virt & (HUGE_1G_SIZE - 1));
+    }
+        
+    uint64_t *pd = (uint64_t *)phys_to_virt(pdpe & PAGE_ADDR_MASK);
+    uint64_t pde = pd[PD_INDEX(virt)];
+    if (!(pde & PAGE_PRESENT))
+        return 0;
+    
+    // Проверка на 2MB страницы
+    if (pde & PAGE_HUGE) {
+        return (pde & PAGE_ADDR_MASK & ~(HUGE_2M_SIZE - 1)) | (virt & (HUGE_2M_SIZE - 1));
+    }
+        
+    uint64_t *pt = (uint64_t *)phys_to_virt(pde & PAGE_ADDR_MASK);
+    uint64_t pte = pt[PT_INDEX(virt)];
+    if (!(pte & PAGE_PRESENT))
+        return 0;
+        
+    return (pte & PAGE_ADDR_MASK) | (virt & ~PAGE_MASK);
+}
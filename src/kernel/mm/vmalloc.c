@@ -0,0 +1,387 @@
+#include "vmalloc.h"
+#include "string.h"
+#include "stdio.h"
+
+static struct {
+    vm_struct_t *root;
+    uintptr_t hint;
+    size_t nr_areas;
+    size_t nr_pages;
+} vmap = { NULL, VMALLOC_START, 0, 0 };
+
+// ================= AVL Tree =================
+
+static inline int vm_height(vm_struct_t *node) {
+    return node ? node->height : 0;
+}
+
+static inline void vm_update(vm_struct_t *node) {
+    int l = vm_height(node->left), r = vm_height(node->right);
+    node->height = (l > r ? l : r) + 1;
+}
+
+static vm_struct_t *vm_rotate_right(vm_struct_t *node) {
+    vm_struct_t *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    vm_update(node);
+    vm_update(left);
+    return left;
+}
+
+static vm_struct_t *vm_rotate_left(vm_struct_t *node) {
+    vm_struct_t *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    vm_update(node);
+    vm_update(right);
+    return right;
+}
+
+static vm_struct_t *vm_balance(vm_struct_t *node) {
+    vm_update(node);
+    int balance = vm_height(node->left) - vm_height(node->right);
+    
+    if (balance > 1) {
+        if (vm_height(node->left->left) < vm_height(node->left->right))
+            node->left = vm_rotate_left(node->left);
+        return vm_rotate_right(node);
+    }
+    
+    if (balance < -1) {
+        if (vm_height(node->right->right) < vm_height(node->right->left))
+            node->right = vm_rotate_right(node->right);
+        return vm_rotate_left(node);
+    }
+    
+    return node;
+}
+
+static vm_struct_t *vm_insert(vm_struct_t *node, vm_struct_t *area) {
+    if (!node) {
+        area->left = area->right = NULL;
+        area->height = 1;
+        return area;
+    }
+        
+    if (area->addr < node->addr)
+        node->left = vm_insert(node->left, area);
+    else
+        node->right = vm_insert(node->right, area);
+        
+    return vm_balance(node);
+}
+
+static vm_struct_t *vm_remove_min(vm_struct_t *node, vm_struct_t **min) {
+    if (!node->left) {
+        *min = node;
+        return node->right;
+    }
+    
+    node->left = vm_remove_min(node->left, min);
+    return vm_balance(node);
+}
+
+static vm_struct_t *vm_remove(vm_struct_t *node, uintptr_t addr) {
+    if (!node)
+        return NULL;
+        
+    if (addr < node->addr) {
+        node->left = vm_remove(node->left, addr);
+    } else if (addr > node->addr) {
+        node->right = vm_remove(node->right, addr);
+    } else {
+        if (!node->right)
+            return node->left;
+            
+        vm_struct_t *min;
+        vm_struct_t *right = vm_remove_min(node->right, &min);
+        min->left = node->left;
+        min->right = right;
+        return vm_balance(min);
+    }
+    
+    return vm_balance(node);
+}
+
+// Первая область, которая заканчивается после addr
+static vm_struct_t *vm_first_after(uintptr_t addr) {
+    vm_struct_t *node = vmap.root, *found = NULL;
+    
+    while (node) {
+        if (node->addr + node->size > addr) {
+            found = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    
+    return found;
+}
+
+vm_struct_t *find_vm_area(const void *ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    vm_struct_t *area = vm_first_after(addr);
+    
+    if (area && area->addr <= addr)
+        return area;
+    return NULL;
+}
+
+// ================= Address Space =================
+
+// Next-fit: поиск продолжается с конца последней выделенной области
+static uintptr_t vm_find_gap(size_t size, size_t align) {
+    uintptr_t start = ALIGN_UP(vmap.hint, align);
+    bool wrapped = false;
+    
+    for (;;) {
+        if (start + size > VMALLOC_END || start < VMALLOC_START) {
+            if (wrapped)
+                return 0;
+            wrapped = true;
+            start = VMALLOC_START;
+            continue;
+        }
+        
+        vm_struct_t *next = vm_first_after(start);
+        if (!next || next->addr >= start + size)
+            return start;
+            
+        start = ALIGN_UP(next->addr + next->size, align);
+    }
+}
+
+// Страница vmalloc переезжает вместе со своим PTE
+static bool vm_migrate(page_t *page, void *new_addr) {
+    vm_struct_t *area = (vm_struct_t *)page->owner;
+    uintptr_t virt = area->addr + page->index * PAGE_SIZE;
+    
+    memcpy(new_addr, area->pages[page->index], PAGE_SIZE);
+    if (map_range(virt, virt_to_phys((uintptr_t)new_addr), PAGE_SIZE, area->prot) != 0)
+        return false;
+        
+    area->pages[page->index] = new_addr;
+    return true;
+}
+
+static uintptr_t vm_vaddr(page_t *page) {
+    return ((vm_struct_t *)page->owner)->addr + page->index * PAGE_SIZE;
+}
+
+static const movable_ops_t vm_mops = {
+    .migrate = vm_migrate,
+    .vaddr = vm_vaddr,
+};
+
+static void vm_free_pages(vm_struct_t *area, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        void *page = area->pages[i];
+        if (!page)
+            continue;
+            
+        if (area->ops && area->ops->release) {
+            area->ops->release(area, i, page);
+        } else {
+            // Страница могла остаться в чужом map_shared
+            clear_page_movable(page);
+            put_page(page);
+        }
+    }
+}
+
+// Берёт блоки максимального доступного порядка и дробит их на страницы order 0,
+// чтобы vfree мог возвращать страницы по одной
+static int vm_populate(vm_struct_t *area) {
+    size_t done = 0;
+    int order = MAX_ORDER;
+    
+    while (done < area->nr_pages) {
+        while ((1UL << order) > area->nr_pages - done)
+            order--;
+            
+        void *block = page_alloc(order);
+        if (!block) {
+            if (order == 0) {
+                unmap_range(area->addr, done * PAGE_SIZE);
+                vm_free_pages(area, done);
+                return -1;
+            }
+            order--;
+            continue;
+        }
+        
+        uintptr_t virt = area->addr + done * PAGE_SIZE;
+        if (map_range(virt, virt_to_phys((uintptr_t)block), PAGE_SIZE << order, 
+                      PAGE_PRESENT | PAGE_WRITABLE) != 0) {
+            page_free(block, order);
+            unmap_range(area->addr, done * PAGE_SIZE);
+            vm_free_pages(area, done);
+            return -1;
+        }
+        
+        split_page(block, order);
+        
+        // Блок от 2 МБ мог лечь одной PDE, такие страницы не переносятся
+        bool movable = order < PD_SHIFT - PAGE_SHIFT;
+        for (size_t i = 0; i < (1UL << order); i++) {
+            void *page = (uint8_t *)block + i * PAGE_SIZE;
+            if (movable)
+                set_page_movable(page, &vm_mops, area, done);
+            area->pages[done++] = page;
+        }
+    }
+    
+    return 0;
+}
+
+// ================= vmalloc =================
+
+static vm_struct_t *vm_area_alloc(size_t size, size_t align) {
+    vm_struct_t *area = (vm_struct_t *)kmalloc(sizeof(vm_struct_t));
+    if (!area)
+        return NULL;
+        
+    memset(area, 0, sizeof(*area));
+    area->nr_pages = size >> PAGE_SHIFT;
+    area->size = size + VMALLOC_GUARD;
+    area->prot = PAGE_PRESENT | PAGE_WRITABLE;
+    area->pages = (void **)kcalloc(area->nr_pages, sizeof(void *));
+    if (!area->pages) {
+        kfree(area);
+        return NULL;
+    }
+    
+    area->addr = vm_find_gap(area->size, align);
+    if (!area->addr) {
+        kfree(area->pages);
+        kfree(area);
+        return NULL;
+    }
+    
+    return area;
+}
+
+static void vm_area_insert(vm_struct_t *area) {
+    vmap.root = vm_insert(vmap.root, area);
+    vmap.hint = area->addr + area->size;
+    vmap.nr_areas++;
+    vmap.nr_pages += area->nr_populated;
+}
+
+void *vmalloc(size_t size) {
+    if (size == 0)
+        return NULL;
+        
+    size = ALIGN_UP(size, PAGE_SIZE);
+    
+    // Крупные области выравниваются на 2 МБ, чтобы map_range мог ставить большие страницы
+    size_t align = size >= HUGE_2M_SIZE ? HUGE_2M_SIZE : PAGE_SIZE;
+    vm_struct_t *area = vm_area_alloc(size, align);
+    if (!area)
+        return NULL;
+        
+    if (vm_populate(area) != 0) {
+        kfree(area->pages);
+        kfree(area);
+        return NULL;
+    }
+    
+    area->nr_populated = area->nr_pages;
+    vm_area_insert(area);
+    return (void *)area->addr;
+}
+
+void *vzalloc(size_t size) {
+    void *ptr = vmalloc(size);
+    if (ptr)
+        memset(ptr, 0, ALIGN_UP(size, PAGE_SIZE));
+    return ptr;
+}
+
+// Только резервирует адреса; страницы выделяются в vmalloc_fault
+void *vm_reserve(size_t size, uint64_t prot, const vm_ops_t *ops, void *private) {
+    if (size == 0)
+        return NULL;
+        
+    vm_struct_t *area = vm_area_alloc(ALIGN_UP(size, PAGE_SIZE), PAGE_SIZE);
+    if (!area)
+        return NULL;
+        
+    area->flags = VM_LAZY;
+    area->prot = prot | PAGE_PRESENT;
+    area->ops = ops;
+    area->private = private;
+    vm_area_insert(area);
+    return (void *)area->addr;
+}
+
+void *vmalloc_lazy(size_t size) {
+    return vm_reserve(size, PAGE_WRITABLE, NULL, NULL);
+}
+
+int vmalloc_fault(uintptr_t addr, uint64_t error) {
+    if (error & PF_PRESENT)
+        return -1;
+        
+    vm_struct_t *area = find_vm_area((void *)addr);
+    if (!area || !(area->flags & VM_LAZY))
+        return -1;
+        
+    // Обращение к guard-странице - настоящая ошибка
+    unsigned long index = (addr - area->addr) >> PAGE_SHIFT;
+    if (index >= area->nr_pages || area->pages[index])
+        return -1;
+        
+    void *page = area->ops ? area->ops->fault(area, index) : alloc_pages(GFP_ZERO, 0);
+    if (!page)
+        return -1;
+        
+    if (map_range(area->addr + index * PAGE_SIZE, virt_to_phys((uintptr_t)page), 
+                  PAGE_SIZE, area->prot) != 0) {
+        if (area->ops && area->ops->release)
+            area->ops->release(area, index, page);
+        else if (!area->ops)
+            page_free(page, 0);
+        return -1;
+    }
+    
+    if (!area->ops)
+        set_page_movable(page, &vm_mops, area, index);
+        
+    area->pages[index] = page;
+    area->nr_populated++;
+    vmap.nr_pages++;
+    return 0;
+}
+
+void vfree(void *addr) {
+    if (!addr)
+        return;
+        
+    vm_struct_t *area = find_vm_area(addr);
+    if (!area || area->addr != (uintptr_t)addr) {
+        printf("vfree: bad address %p\n", addr);
+        return;
+    }
+    
+    vmap.root = vm_remove(vmap.root, area->addr);
+    vmap.nr_areas--;
+    vmap.nr_pages -= area->nr_populated;
+    
+    unmap_range(area->addr, area->nr_pages * PAGE_SIZE);
+    vm_free_pages(area, area->nr_pages);
+    
+    kfree(area->pages);
+    kfree(area);
+}
+
+size_t vmalloc_nr_pages(void) {
+    return vmap.nr_pages;
+}
+
+void vmalloc_dump_stats(void) {
+    printf("  vmalloc: %u areas, %u pages backed\n", 
+          (unsigned int)vmap.nr_areas, (unsigned int)vmap.nr_pages);
+}
@@ -0,0 +1,47 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include "mem.h"
+
+#define VMALLOC_START   0xFFFFC90000000000UL
+#define VMALLOC_END     0xFFFFE90000000000UL
+#define VMALLOC_GUARD   PAGE_SIZE
+
+#define VM_LAZY         (1 << 0)    // страницы появляются при первом обращении
+
+struct vm_struct;
+
+// Источник страниц ленивой области. fault возвращает страницу в прямом
+// отображении, ссылку на неё область отдаёт обратно через release;
+// без ops страницы анонимные и заполняются нулями
+typedef struct vm_ops {
+    void *(*fault)(struct vm_struct *area, unsigned long index);
+    void (*release)(struct vm_struct *area, unsigned long index, void *page);
+} vm_ops_t;
+
+typedef struct vm_struct {
+    struct vm_struct *left;
+    struct vm_struct *right;
+    int height;
+    uintptr_t addr;
+    size_t size;                // вместе с guard-страницей
+    size_t nr_pages;
+    void **pages;               // страницы order 0 в прямом отображении, NULL - ещё нет
+    size_t nr_populated;
+    unsigned int flags;
+    uint64_t prot;
+    const vm_ops_t *ops;
+    void *private;
+} vm_struct_t;
+
+void *vmalloc(size_t size);
+void *vzalloc(size_t size);
+void *vmalloc_lazy(size_t size);
+void *vm_reserve(size_t size, uint64_t prot, const vm_ops_t *ops, void *private);
+int vmalloc_fault(uintptr_t addr, uint64_t error);
+void vfree(void *addr);
+vm_struct_t *find_vm_area(const void *addr);
+void vmalloc_dump_stats(void);
+size_t vmalloc_nr_pages(void);
+
+#endif
@@ -4,6 +4,8 @@
 #include <pros.h>
 #include "../../drivers/power/power.h"
 #include "../../drivers/keyboard/keyboard.h"
+#include "../mm/mem.h"
+#include "../mm/aspace.h"
 
 #define MAX_ARGS 16
 #define MAX_ARG_LENGTH 64
@@ -40,6 +42,38 @@ static int parse_args(char* input, int* argc, char argv[MAX_ARGS][MAX_ARG_LENGTH
     return 0;
 }
 
+static void print_meminfo(void) {
+    meminfo_t info;
+    mm_get_meminfo(&info);
+    
+    printf("Total: %u KB, free: %u KB\n", 
+           (unsigned int)(info.total_pages * (PAGE_SIZE / 1024)),
+           (unsigned int)(info.free_pages * (PAGE_SIZE / 1024)));
+    printf("Slab: %u KB, vmalloc: %u KB, zeroed pool: %u KB, page cache: %u KB\n",
+           (unsigned int)(info.slab_pages * (PAGE_SIZE / 1024)),
+           (unsigned int)(info.vmalloc_pages * (PAGE_SIZE / 1024)),
+           (unsigned int)(info.zero_pool_pages * (PAGE_SIZE / 1024)),
+           (unsigned int)(info.pagecache_pages * (PAGE_SIZE / 1024)));
+    
+    printf("Free blocks by order:");
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        printf(" %u", (unsigned int)info.free_blocks[i]);
+    }
+    printf("\n");
+    
+    for (unsigned int i = 0; i < info.nr_caches; i++) {
+        meminfo_cache_t *c = &info.caches[i];
+        if (c->objects)
+            printf("  %s: %u/%u objects, %u pages\n", c->name, c->active, c->objects, c->pages);
+    }
+    if (info.caches_omitted)
+        printf("  ... %u more caches\n", info.caches_omitted);
+    
+    for (int i = 0; i < MM_NR_TAGS; i++) {
+        printf("  [%s] %u bytes\n", mm_tag_name(i), (unsigned int)info.tag_bytes[i]);
+    }
+}
+
 void handle_command(char* input) {
     int argc;
     char argv[MAX_ARGS][MAX_ARG_LENGTH];
@@ -63,10 +97,26 @@ void handle_command(char* input) {
             printf("  cat      - read file (2 argv - path)\n");
             printf("  ls       - listing directory (2 argv - path)\n");
             printf("  fsinfo   - file system info\n");
+            printf("  meminfo  - memory usage\n");
+            printf("  tlbbench - address space switch cost\n");
+            printf("  atastat  - disk request statistics\n");
+            printf("  atabench - disk command latency\n");
         }
         else if (strcmp(argv[0], "clear") == 0) {
             clear();
         }
+        else if (strcmp(argv[0], "meminfo") == 0) {
+            print_meminfo();
+        }
+        else if (strcmp(argv[0], "tlbbench") == 0) {
+            aspace_bench();
+        }
+        else if (strcmp(argv[0], "atastat") == 0) {
+            ata_dump_stats();
+        }
+        else if (strcmp(argv[0], "atabench") == 0) {
+            ata_bench(get_ata_device(0));
+        }
         else {
             printf("Unknown command: %s\n", argv[0]);
             printf("Type 'help' for available commands\n");
@@ -0,0 +1,406 @@
+// Стресс-тесты и микробенчмарки buddy/slab на хосте: make host-mm-bench.
+// Результаты - по одному JSON-объекту на строку в stdout, лог ядра уходит в stderr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mem.h"
+#include "internal.h"
+#include "../boot/multiboot2.h"
+
+#define DEFAULT_ARENA_MB    512
+#define DEFAULT_SEED        1
+#define STRESS_SLOTS        4096
+#define STRESS_OPS          400000
+#define LATENCY_BATCH       1024
+#define LATENCY_ROUNDS      64
+#define CHURN_SLOTS         16384
+#define CHURN_OPS           500000
+#define KFREE_BATCH         1000
+#define KFREE_ROUNDS        100
+
+typedef struct {
+    void *ptr;
+    size_t size;
+    int order;              // -1 - kmalloc, иначе page_alloc
+    uint8_t fill;
+} slot_t;
+
+static uint64_t rng_state;
+static unsigned long baseline_free;
+static uint64_t baseline_requested, baseline_allocated;
+
+static uint64_t rng(void) {
+    uint64_t x = rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng_state = x;
+    return x * 0x2545F4914F6CDD1DUL;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// В основном мелкие объекты, изредка - крупнее slab
+static size_t random_size(void) {
+    uint64_t r = rng() % 100;
+    if (r < 70)
+        return 1 + rng() % 256;
+    if (r < 95)
+        return 257 + rng() % 3840;
+    return 4097 + rng() % 61440;
+}
+
+static void fail(const char *test, const char *what, uint64_t op) {
+    printf("{\"test\":\"%s\",\"result\":\"fail\",\"error\":\"%s\",\"op\":%llu}\n",
+           test, what, (unsigned long long)op);
+    exit(1);
+}
+
+static bool check_fill(const slot_t *s, size_t size) {
+    const uint8_t *p = s->ptr;
+    for (size_t i = 0; i < size; i++) {
+        if (p[i] != s->fill)
+            return false;
+    }
+    return true;
+}
+
+static void slot_free(slot_t *s) {
+    if (s->order < 0)
+        kfree(s->ptr);
+    else
+        page_free(s->ptr, s->order);
+    s->ptr = NULL;
+}
+
+static unsigned long free_pages_now(void) {
+    meminfo_t info;
+    kmem_shrink_all();
+    mm_get_meminfo(&info);
+    return info.free_pages + info.zero_pool_pages;
+}
+
+// Случайные kmalloc/kcalloc/krealloc/page_alloc с проверкой содержимого:
+// перекрытие двух выделений или порча при realloc сразу видны по шаблону
+static void test_stress(uint64_t ops) {
+    static slot_t slots[STRESS_SLOTS];
+
+    for (uint64_t op = 0; op < ops; op++) {
+        slot_t *s = &slots[rng() % STRESS_SLOTS];
+        uint64_t r = rng() % 100;
+
+        // Пул обнулённых страниц, как из цикла простоя ядра
+        if (op % 256 == 0)
+            mm_idle();
+
+        if (!s->ptr) {
+            s->fill = (uint8_t)(rng() | 1);
+            s->order = -1;
+
+            if (r < 60) {
+                s->size = random_size();
+                s->ptr = kmalloc(s->size);
+            } else if (r < 75) {
+                s->size = 8 * (1 + rng() % 1024);
+                s->ptr = kcalloc(s->size / 8, 8);
+                if (s->ptr) {
+                    for (size_t i = 0; i < s->size; i++) {
+                        if (((uint8_t *)s->ptr)[i])
+                            fail("stress", "kcalloc not zeroed", op);
+                    }
+                }
+            } else if (r < 85) {
+                s->size = random_size();
+                s->ptr = kmalloc_tag(s->size, MM_TAG_PROS);
+            } else {
+                s->order = rng() % 4;
+                s->size = PAGE_SIZE << s->order;
+                s->ptr = page_alloc(s->order);
+            }
+
+            if (!s->ptr)
+                fail("stress", "out of memory", op);
+            if (((uintptr_t)s->ptr & 7) != 0)
+                fail("stress", "misaligned", op);
+            if (s->order < 0 && kmalloc_size(s->ptr) < s->size)
+                fail("stress", "kmalloc_size too small", op);
+
+            memset(s->ptr, s->fill, s->size);
+            continue;
+        }
+
+        if (!check_fill(s, s->size))
+            fail("stress", "corrupted", op);
+
+        if (r < 50) {
+            slot_free(s);
+        } else if (r < 80 && s->order < 0) {
+            size_t new_size = random_size();
+            void *p = krealloc(s->ptr, new_size);
+            if (!p)
+                fail("stress", "krealloc failed", op);
+
+            s->ptr = p;
+            if (!check_fill(s, s->size < new_size ? s->size : new_size))
+                fail("stress", "krealloc lost data", op);
+
+            s->size = new_size;
+            memset(s->ptr, s->fill, s->size);
+        }
+    }
+
+    for (int i = 0; i < STRESS_SLOTS; i++) {
+        if (slots[i].ptr) {
+            if (!check_fill(&slots[i], slots[i].size))
+                fail("stress", "corrupted", ops);
+            slot_free(&slots[i]);
+        }
+    }
+
+    unsigned long after = free_pages_now();
+    if (after != baseline_free)
+        fail("stress", "pages leaked", ops);
+
+    printf("{\"test\":\"stress\",\"result\":\"pass\",\"ops\":%llu}\n", (unsigned long long)ops);
+}
+
+static void bench_latency(void) {
+    static void *ptrs[LATENCY_BATCH];
+    static const size_t sizes[] = {
+        16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536,
+        2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768, 65536
+    };
+
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        uint64_t alloc_ns = 0, free_ns = 0, count = 0;
+
+        for (int round = 0; round < LATENCY_ROUNDS; round++) {
+            uint64_t t0 = now_ns();
+            for (int i = 0; i < LATENCY_BATCH; i++) {
+                ptrs[i] = kmalloc(sizes[k]);
+            }
+            uint64_t t1 = now_ns();
+            for (int i = 0; i < LATENCY_BATCH; i++) {
+                kfree(ptrs[i]);
+            }
+            uint64_t t2 = now_ns();
+
+            alloc_ns += t1 - t0;
+            free_ns += t2 - t1;
+            count += LATENCY_BATCH;
+        }
+
+        printf("{\"bench\":\"kmalloc_latency\",\"size\":%zu,\"alloc_ns\":%.1f,\"free_ns\":%.1f}\n",
+               sizes[k], (double)alloc_ns / count, (double)free_ns / count);
+    }
+
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        uint64_t alloc_ns = 0, free_ns = 0, count = 0;
+        int batch = 64;
+
+        for (int round = 0; round < LATENCY_ROUNDS; round++) {
+            int got = 0;
+            uint64_t t0 = now_ns();
+            while (got < batch && (ptrs[got] = page_alloc(order)) != NULL) {
+                got++;
+            }
+            uint64_t t1 = now_ns();
+            for (int i = 0; i < got; i++) {
+                page_free(ptrs[i], order);
+            }
+            uint64_t t2 = now_ns();
+
+            alloc_ns += t1 - t0;
+            free_ns += t2 - t1;
+            count += got;
+        }
+
+        printf("{\"bench\":\"page_alloc_latency\",\"order\":%d,\"alloc_ns\":%.1f,\"free_ns\":%.1f}\n",
+               order, count ? (double)alloc_ns / count : 0.0, count ? (double)free_ns / count : 0.0);
+    }
+}
+
+// После долгой случайной нагрузки освобождается каждое второе выделение -
+// так остаётся худший для buddy рисунок занятости
+static void bench_fragmentation(void) {
+    static slot_t slots[CHURN_SLOTS];
+
+    for (uint64_t op = 0; op < CHURN_OPS; op++) {
+        slot_t *s = &slots[rng() % CHURN_SLOTS];
+        if (s->ptr) {
+            kfree(s->ptr);
+            s->ptr = NULL;
+        } else {
+            s->size = random_size();
+            s->order = -1;
+            s->ptr = kmalloc(s->size);
+        }
+    }
+
+    for (int i = 0; i < CHURN_SLOTS; i += 2) {
+        if (slots[i].ptr) {
+            kfree(slots[i].ptr);
+            slots[i].ptr = NULL;
+        }
+    }
+    kmem_shrink_all();
+
+    meminfo_t info;
+    mm_get_meminfo(&info);
+
+    unsigned long high = 0;
+    for (int order = MAX_ORDER - 1; order <= MAX_ORDER; order++) {
+        high += info.free_blocks[order] << order;
+    }
+
+    uint64_t slab_used = 0, slab_bytes = (uint64_t)info.slab_pages * PAGE_SIZE;
+    for (unsigned int i = 0; i < info.nr_caches; i++) {
+        slab_used += (uint64_t)info.caches[i].active * info.caches[i].obj_size;
+    }
+
+    printf("{\"bench\":\"fragmentation\",\"ops\":%d,\"free_pages\":%lu,\"free_high_order_pct\":%.2f,"
+           "\"slab_pages\":%lu,\"slab_utilization_pct\":%.2f,\"free_blocks\":[",
+           CHURN_OPS, info.free_pages, info.free_pages ? 100.0 * high / info.free_pages : 0.0,
+           info.slab_pages, slab_bytes ? 100.0 * slab_used / slab_bytes : 0.0);
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        printf(order ? ",%lu" : "%lu", info.free_blocks[order]);
+    }
+    printf("]}\n");
+
+    // Сколько блоков MAX_ORDER удаётся получить с учётом компактизации
+    static void *blocks[4096];
+    int nr_blocks = 0;
+    uint64_t t0 = now_ns();
+    while (nr_blocks < 4096 && (blocks[nr_blocks] = page_alloc(MAX_ORDER)) != NULL) {
+        nr_blocks++;
+    }
+    uint64_t t1 = now_ns();
+
+    printf("{\"bench\":\"high_order_after_churn\",\"order\":%d,\"blocks\":%d,\"possible\":%lu,\"total_ns\":%llu}\n",
+           MAX_ORDER, nr_blocks, info.free_pages >> MAX_ORDER, (unsigned long long)(t1 - t0));
+
+    for (int i = 0; i < nr_blocks; i++) {
+        page_free(blocks[i], MAX_ORDER);
+    }
+    for (int i = 0; i < CHURN_SLOTS; i++) {
+        if (slots[i].ptr) {
+            kfree(slots[i].ptr);
+            slots[i].ptr = NULL;
+        }
+    }
+}
+
+// kfree не должен дорожать с ростом числа живых объектов
+static void bench_kfree_scaling(void) {
+    static const size_t heaps[] = { 1000, 10000, 100000, 1000000 };
+
+    for (size_t h = 0; h < sizeof(heaps) / sizeof(heaps[0]); h++) {
+        size_t n = heaps[h];
+        void **live = malloc(n * sizeof(void *));
+        size_t got = 0;
+
+        while (got < n && (live[got] = kmalloc(16 + rng() % 241)) != NULL) {
+            got++;
+        }
+
+        // Перемешиваем, чтобы освобождения шли вразнобой по слабам
+        for (size_t i = got; i > 1; i--) {
+            size_t j = rng() % i;
+            void *tmp = live[i - 1];
+            live[i - 1] = live[j];
+            live[j] = tmp;
+        }
+
+        uint64_t free_ns = 0, count = 0;
+
+        for (int round = 0; round < KFREE_ROUNDS && got >= KFREE_BATCH; round++) {
+            size_t base = rng() % (got - KFREE_BATCH + 1);
+
+            uint64_t t0 = now_ns();
+            for (int i = 0; i < KFREE_BATCH; i++) {
+                kfree(live[base + i]);
+            }
+            free_ns += now_ns() - t0;
+            count += KFREE_BATCH;
+
+            for (int i = 0; i < KFREE_BATCH; i++) {
+                live[base + i] = kmalloc(16 + rng() % 241);
+            }
+        }
+
+        printf("{\"bench\":\"kfree_vs_heap\",\"live_objects\":%zu,\"requested\":%zu,\"kfree_ns\":%.1f}\n",
+               got, n, count ? (double)free_ns / count : 0.0);
+
+        for (size_t i = 0; i < got; i++) {
+            kfree(live[i]);
+        }
+        free(live);
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t arena_mb = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_ARENA_MB;
+    rng_state = argc > 2 ? strtoull(argv[2], NULL, 0) : DEFAULT_SEED;
+    if (!rng_state)
+        rng_state = DEFAULT_SEED;
+
+    // Запас на выравнивание, чтобы buddy сразу получил блоки MAX_ORDER
+    size_t size = arena_mb << 20;
+    uint8_t *raw = mmap(NULL, size + BUDDY_MAX_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    uintptr_t arena = ALIGN_UP((uintptr_t)raw, BUDDY_MAX_SIZE);
+
+    // Multiboot2 с одной записью карты памяти: вся арена доступна
+    static uint64_t mbi[8];
+    uint8_t *p = (uint8_t *)mbi;
+    struct multiboot_tag_mmap *mmap_tag = (struct multiboot_tag_mmap *)(p + 8);
+    mmap_tag->type = MULTIBOOT_TAG_TYPE_MMAP;
+    mmap_tag->size = sizeof(*mmap_tag) + sizeof(struct multiboot_mmap_entry);
+    mmap_tag->entry_size = sizeof(struct multiboot_mmap_entry);
+    mmap_tag->entries[0].addr = arena;
+    mmap_tag->entries[0].len = size;
+    mmap_tag->entries[0].type = MULTIBOOT_MEMORY_AVAILABLE;
+    struct multiboot_tag *end = (struct multiboot_tag *)(p + 8 + ALIGN_UP(mmap_tag->size, 8));
+    end->type = MULTIBOOT_TAG_TYPE_END;
+    end->size = 8;
+    ((struct multiboot_header *)p)->total_size = (uint8_t *)(end + 1) - p;
+
+    fflush(stdout);
+    int saved_stdout = dup(1);
+    dup2(2, 1);
+    mm_init(MULTIBOOT2_BOOTLOADER_MAGIC, mbi);
+    fflush(stdout);
+    dup2(saved_stdout, 1);
+    close(saved_stdout);
+
+    baseline_free = free_pages_now();
+    baseline_requested = mm.kmalloc_requested;
+    baseline_allocated = mm.kmalloc_allocated;
+    printf("{\"config\":{\"arena_mb\":%zu,\"seed\":%llu,\"free_pages\":%lu}}\n",
+           arena_mb, (unsigned long long)rng_state, baseline_free);
+
+    test_stress(STRESS_OPS);
+    bench_latency();
+    bench_fragmentation();
+    bench_kfree_scaling();
+
+    if (free_pages_now() != baseline_free ||
+        mm.kmalloc_requested != baseline_requested ||
+        mm.kmalloc_allocated != baseline_allocated) {
+        printf("{\"test\":\"final_leak_check\",\"result\":\"fail\"}\n");
+        return 1;
+    }
+    printf("{\"test\":\"final_leak_check\",\"result\":\"pass\"}\n");
+    return 0;
+}
@@ -0,0 +1,35 @@
+// Замена paging.c для сборки mm/ на хосте. "Физическая" память - арена из mmap,
+// её адреса совпадают с виртуальными, поэтому phys_offset остаётся нулевым
+#include "internal.h"
+
+uint64_t pml4_table_phys;
+char kernel_start[1], kernel_end[1];
+
+// Прямого отображения нет: в статистику идёт размер арены
+bool paging_init_direct_map(uint64_t max_addr) {
+    uint64_t min_addr = max_addr;
+    for (int i = 0; i < mm.nr_usable; i++) {
+        if (mm.usable[i].start < min_addr)
+            min_addr = mm.usable[i].start;
+    }
+    
+    mm.direct_map_end = max_addr - min_addr;
+    return true;
+}
+
+void paging_init(void) {
+}
+
+// Таблиц страниц нет, vmalloc на хосте всегда отказывает
+int map_range(uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags) {
+    (void)virt; (void)phys; (void)size; (void)flags;
+    return -1;
+}
+
+void unmap_range(uintptr_t virt, size_t size) {
+    (void)virt; (void)size;
+}
+
+uintptr_t virt_to_phys(uintptr_t virt) {
+    return virt;
+}